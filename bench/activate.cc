@@ -0,0 +1,86 @@
+/* CENV - C/C++ environments
+ *
+ * Copyright 2020  Jakub Kaszycki
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cenv.hh"
+#include "bench.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+#include <unistd.h>
+
+static void
+run (const std::string &folder,
+     std::size_t suffixes)
+{
+  cenv::config cfg;
+  cfg.folder = folder;
+  cfg.variables["mach_type"] = "x86_64-linux-gnu";
+
+  // Every search variable gets the same number of suffixes
+  for (std::size_t i = 0; i < suffixes; ++i)
+    {
+      const std::string prefix {"opt/pkg" + std::to_string (i)};
+
+      cfg.add_suffix (cfg.executable_suffixes, prefix + "/bin");
+      cfg.add_suffix (cfg.include_suffixes, prefix + "/include");
+      cfg.add_suffix (cfg.info_suffixes, prefix + "/share/info");
+      cfg.add_suffix (cfg.library_suffixes, prefix + "/lib/${mach_type}");
+      cfg.add_suffix (cfg.manpage_suffixes, prefix + "/share/man");
+      cfg.add_suffix (cfg.pkg_config_suffixes, prefix + "/lib/pkgconfig");
+    }
+
+  cfg.add_default_configs ();
+
+  const std::string name {"suffixes=" + std::to_string (suffixes)};
+  std::ostringstream out;
+
+  // Once the templates are expanded, as for every format after the
+  // first one
+  bench::report ("write-activate", name, bench::time_per_call ([&] () {
+    out.str ({});
+    cfg.write_activate_script (out);
+  }), "ns");
+
+  // With every template expanded again, as for a new environment
+  bench::report ("write-activate-cold", name, bench::time_per_call ([&] () {
+    cfg.templates.clear ();
+    out.str ({});
+    cfg.write_activate_script (out);
+  }), "ns");
+}
+
+int
+main ()
+{
+  char folder[] = "/tmp/cenv-bench-XXXXXX";
+
+  if (!mkdtemp (folder))
+    {
+      std::perror ("Creating the folder");
+      return 1;
+    }
+
+  for (std::size_t suffixes : {1, 10, 100, 1000})
+    run (folder, suffixes);
+
+  rmdir (folder);
+  return 0;
+}
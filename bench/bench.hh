@@ -0,0 +1,71 @@
+/* CENV - C/C++ environments
+ *
+ * Copyright 2020  Jakub Kaszycki
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Shared by the benchmarks: each result is printed as one JSON object
+// per line, so that CI can collect the output of every benchmark as is.
+
+#ifndef CENV_BENCH_HH
+#define CENV_BENCH_HH
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+namespace bench
+{
+  // Prints one result, such as
+  // {"benchmark":"nesting","case":"depth=16","value":12.5,"unit":"ns"}
+  inline void
+  report (const char *benchmark,
+          const std::string &name,
+          double value,
+          const char *unit)
+  {
+    std::printf ("{\"benchmark\":\"%s\",\"case\":\"%s\",\"value\":%.6g,"
+                 "\"unit\":\"%s\"}\n",
+                 benchmark, name.c_str (), value, unit);
+    std::fflush (stdout);
+  }
+
+  // Calls fn until a quarter of a second has passed, at least once, and
+  // returns the average time of a call in nanoseconds
+  template <typename Function>
+  double
+  time_per_call (Function fn)
+  {
+    using clock = std::chrono::steady_clock;
+
+    const auto start = clock::now ();
+    const auto until = start + std::chrono::milliseconds {250};
+    unsigned long calls = 0;
+    clock::time_point now;
+
+    do
+      {
+        fn ();
+        ++calls;
+        now = clock::now ();
+      }
+    while (now < until);
+
+    return std::chrono::duration<double, std::nano> (now - start).count ()
+      / calls;
+  }
+}
+
+#endif /* CENV_BENCH_HH */
@@ -0,0 +1,145 @@
+/* CENV - C/C++ environments
+ *
+ * Copyright 2020  Jakub Kaszycki
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs the cenv executable given as the first argument, and bash on
+// the scripts it writes.
+
+#include "cenv.hh"
+#include "bench.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// Runs the command with the output thrown away and returns whether it
+// succeeded
+static bool
+run_command (const std::vector<std::string> &args)
+{
+  std::vector<char *> argv;
+
+  for (const auto &arg : args)
+    argv.push_back (const_cast<char *> (arg.c_str ()));
+
+  argv.push_back (nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_addopen (&actions, STDOUT_FILENO, "/dev/null",
+                                    O_WRONLY, 0);
+
+  pid_t pid;
+  int error = posix_spawnp (&pid, argv[0], &actions, nullptr, argv.data (),
+                            environ);
+  posix_spawn_file_actions_destroy (&actions);
+
+  if (error)
+    return false;
+
+  int status;
+
+  while (waitpid (pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return false;
+
+  return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+static void
+check (bool ok,
+       const char *what)
+{
+  if (!ok)
+    {
+      std::fprintf (stderr, "%s failed\n", what);
+      std::exit (1);
+    }
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  if (argc != 2)
+    {
+      std::fprintf (stderr, "Usage: %s path/to/cenv\n", argv[0]);
+      return 2;
+    }
+
+  const std::string cenv {argv[1]};
+  char parent[] = "/tmp/cenv-bench-XXXXXX";
+
+  if (!mkdtemp (parent))
+    {
+      std::perror ("Creating the folder");
+      return 1;
+    }
+
+  // A new folder every time
+  unsigned long count = 0;
+  bool ok = true;
+
+  bench::report ("create", "cold", bench::time_per_call ([&] () {
+    const std::string folder {parent + ("/cold" + std::to_string (count++))};
+    ok = ok && run_command ({cenv, "-f", "all", folder});
+  }), "ns");
+  check (ok, "Creating a new environment");
+
+  // The same folder, which is up to date after the first run
+  const std::string folder {std::string {parent} + "/warm"};
+
+  bench::report ("create", "warm", bench::time_per_call ([&] () {
+    ok = ok && run_command ({cenv, "-f", "all", folder});
+  }), "ns");
+  check (ok, "Creating the same environment again");
+
+  // One bash sources the script and deactivates it in a loop; the same
+  // loop without them is taken away
+  const unsigned long loops = 1000;
+  const std::string loop {"for ((i = 0; i < " + std::to_string (loops)
+                          + "; ++i)); do "};
+
+  for (const char *script : {"activate", "activate.sh"})
+    {
+      const std::string path {folder + '/' + script};
+
+      const double with = bench::time_per_call ([&] () {
+        ok = ok && run_command ({"bash", "-c",
+                                 loop + ". \"$1\"; deactivate; done",
+                                 "bash", path});
+      });
+
+      const double without = bench::time_per_call ([&] () {
+        ok = ok && run_command ({"bash", "-c", loop + ":; done"});
+      });
+
+      check (ok, "Sourcing the script with bash");
+      bench::report ("bash-source-deactivate", script,
+                     (with - without) / loops, "ns");
+    }
+
+  cenv::remove_tree (parent);
+  return 0;
+}
@@ -0,0 +1,158 @@
+/* CENV - C/C++ environments
+ *
+ * Copyright 2020  Jakub Kaszycki
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cenv.hh"
+#include "bench.hh"
+
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <stack>
+#include <string>
+
+// Every heap allocation goes through here, so the benchmark can report
+// how many of them a single expansion costs.
+static unsigned long allocations {0};
+
+void *
+operator new (std::size_t size)
+{
+  ++allocations;
+
+  if (void *ptr = std::malloc (size ? size : 1))
+    return ptr;
+
+  throw std::bad_alloc {};
+}
+
+void
+operator delete (void *ptr)
+  noexcept
+{
+  std::free (ptr);
+}
+
+void
+operator delete (void *ptr,
+                 std::size_t)
+  noexcept
+{
+  std::free (ptr);
+}
+
+// The engine the arena replaced, for reference: every level of nesting
+// owns a string on a std::stack
+class stack_substitution final
+{
+public:
+  stack_substitution (const cenv::variable_map &variables,
+                      std::string &output)
+    noexcept
+    : variables {variables}, output {output}
+  {
+  }
+
+  void
+  literal (const char *begin,
+           const char *end)
+  {
+    if (!stack.empty ())
+      stack.top ().append (begin, end);
+    else
+      output.append (begin, end);
+  }
+
+  void
+  push ()
+  {
+    stack.emplace ();
+  }
+
+  void
+  pop ()
+  {
+    auto str {std::move (stack.top ())};
+    stack.pop ();
+
+    const std::string &value = cenv::lookup_variable (variables, str);
+    literal (value.data (), value.data () + value.size ());
+  }
+
+private:
+  const cenv::variable_map &variables;
+  std::string &output;
+  std::stack<std::string> stack {};
+};
+
+template <typename Engine>
+static void
+run (const char *engine,
+     std::size_t depth)
+{
+  // ${${...${v}...}} where v names itself, so every level resolves
+  cenv::variable_map variables;
+  variables["v"] = "v";
+  std::string input;
+
+  for (std::size_t i = 0; i < depth; ++i)
+    input.append ("${");
+
+  input.push_back ('v');
+  input.append (depth, '}');
+
+  const unsigned long iterations = (1ul << 20) / depth;
+  std::string output;
+  output.reserve (16);
+
+  const unsigned long allocations_before = allocations;
+  const auto start = std::chrono::steady_clock::now ();
+
+  for (unsigned long i = 0; i < iterations; ++i)
+    {
+      output.clear ();
+
+      Engine substitution {variables, output};
+      cenv::substitution_parser<Engine> parser {substitution};
+      parser.feed (input.data (), input.data () + input.size ());
+      parser.finish ();
+    }
+
+  const auto end = std::chrono::steady_clock::now ();
+  const unsigned long allocations_after = allocations;
+
+  const double ns = std::chrono::duration<double, std::nano>
+    (end - start).count ();
+
+  const std::string name {engine + (" depth=" + std::to_string (depth))};
+  bench::report ("nesting", name, ns / iterations, "ns");
+  bench::report ("nesting-allocations", name,
+                 double (allocations_after - allocations_before) / iterations,
+                 "allocations");
+}
+
+int
+main ()
+{
+  for (std::size_t depth : {1, 16, 1024})
+    {
+      run<cenv::substitution> ("arena", depth);
+      run<stack_substitution> ("stack", depth);
+    }
+
+  return 0;
+}
@@ -0,0 +1,102 @@
+/* CENV - C/C++ environments
+ *
+ * Copyright 2020  Jakub Kaszycki
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cenv.hh"
+#include "bench.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// About 4 MiB of input for every case, made by repeating a piece
+static std::string
+repeat (const std::string &piece)
+{
+  std::string input;
+
+  while (input.size () < (4u << 20))
+    input.append (piece);
+
+  return input;
+}
+
+static void
+run (const char *name,
+     const std::string &input,
+     const cenv::variable_map &variables)
+{
+  std::string output;
+  output.reserve (input.size () * 2);
+
+  const double ns = bench::time_per_call ([&] () {
+    output.clear ();
+    cenv::substitute_vars (input.data (), input.data () + input.size (),
+                           output, variables);
+  });
+
+  bench::report ("substitution", name, input.size () / ns * 1000.0,
+                 "MB/s");
+
+  // The same through a file, which gets mapped, into /dev/null
+  char path[] = "/tmp/cenv-bench-XXXXXX";
+  int in = mkstemp (path);
+  int out = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+
+  if (in < 0 || out < 0
+      || write (in, input.data (), input.size ()) != (ssize_t) input.size ())
+    {
+      std::perror ("Preparing the input file");
+      std::exit (1);
+    }
+
+  unlink (path);
+
+  const double fd_ns = bench::time_per_call ([&] () {
+    cenv::substitute_vars (in, out, variables);
+  });
+
+  bench::report ("substitution-fd", name, input.size () / fd_ns * 1000.0,
+                 "MB/s");
+
+  close (in);
+  close (out);
+}
+
+int
+main ()
+{
+  cenv::variable_map variables;
+  variables["prefix"] = "/usr/local";
+  variables["mach_type"] = "x86_64-linux-gnu";
+
+  // Mostly text, a variable every few lines
+  std::string text;
+
+  for (int i = 0; i < 40; ++i)
+    text.append ("The quick brown fox jumps over the lazy dog, twice.\n");
+
+  run ("literal-heavy", repeat (text + "${prefix}/lib\n"), variables);
+
+  // Almost nothing but variables
+  run ("variable-heavy", repeat ("${prefix}/${mach_type}:"), variables);
+
+  return 0;
+}
@@ -0,0 +1,5178 @@
+/* CENV - C/C++ environments
+ *
+ * Copyright 2020  Jakub Kaszycki
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CENV_HH
+#define CENV_HH
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef HAVE_FICLONE
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+namespace cenv
+{
+  class syntax_exception final : public std::logic_error
+  {
+  public:
+    syntax_exception (const char *msg)
+      noexcept
+      : logic_error {msg}
+    {
+    }
+
+    syntax_exception (const std::string &msg)
+      noexcept
+      : logic_error {msg}
+    {
+    }
+  };
+
+  class environment_exception final : public std::runtime_error
+  {
+  public:
+    environment_exception (const char *msg)
+      noexcept
+      : runtime_error {msg}
+    {
+    }
+
+    environment_exception (const std::string &msg)
+      noexcept
+      : runtime_error {msg}
+    {
+    }
+  };
+
+  // A command that could not be run.  The errno of the exec is kept,
+  // since callers set their exit status from it, as shells do.
+  class exec_exception final : public std::runtime_error
+  {
+  public:
+    exec_exception (const std::string &msg,
+                    int errnum)
+      noexcept
+      : runtime_error {msg}, errnum_ {errnum}
+    {
+    }
+
+    int
+    error ()
+      const noexcept
+    {
+      return errnum_;
+    }
+
+  private:
+    int errnum_;
+  };
+
+  // strerror_r is either the XSI or the GNU flavour, depending on the C
+  // library.  Unlike strerror, both are safe to call from any thread.
+  inline const char *
+  strerror_result (int,
+                   const char *buffer)
+    noexcept
+  {
+    return buffer;
+  }
+
+  inline const char *
+  strerror_result (const char *msg,
+                   const char *)
+    noexcept
+  {
+    return msg;
+  }
+
+  inline std::string
+  errno_message (int errnum)
+  {
+    char buffer[256] {};
+    return strerror_result (strerror_r (errnum, buffer, sizeof (buffer)),
+                            buffer);
+  }
+
+  inline environment_exception
+  system_failure (const char *what,
+                  const std::string &path,
+                  int errnum)
+  {
+    std::ostringstream msg_builder;
+    msg_builder << what << ' ' << path << " failed: "
+                << errno_message (errnum);
+    return environment_exception {msg_builder.str ()};
+  }
+
+  // What --stats reports.  Batch mode creates environments from several
+  // threads, so the counters are atomic; nothing is counted unless
+  // enabled is set, before any work starts.
+  struct statistics
+  {
+    enum phase
+    {
+      make_directories,
+      resolve_paths,
+      expand,
+      render,
+      lock,
+      write,
+      phase_count
+    };
+
+    bool enabled {false};
+    std::array<std::atomic<std::uint64_t>, phase_count> nanoseconds {};
+    std::atomic<std::uint64_t> bytes_written {0};
+    std::atomic<std::uint64_t> templates_expanded {0};
+    std::atomic<std::uint64_t> variable_lookups {0};
+  };
+
+  inline statistics &
+  stats ()
+    noexcept
+  {
+    static statistics instance;
+    return instance;
+  }
+
+  inline void
+  count (std::atomic<std::uint64_t> &counter,
+         std::uint64_t amount = 1)
+    noexcept
+  {
+    if (stats ().enabled)
+      counter.fetch_add (amount, std::memory_order_relaxed);
+  }
+
+  // Adds its lifetime to a phase of the statistics
+  class phase_timer final
+  {
+  public:
+    explicit phase_timer (statistics::phase which)
+      noexcept
+      : which (which)
+    {
+      if (stats ().enabled)
+        start = std::chrono::steady_clock::now ();
+    }
+
+    phase_timer (const phase_timer &) = delete;
+    phase_timer &operator= (const phase_timer &) = delete;
+
+    ~phase_timer ()
+    {
+      if (stats ().enabled)
+        count (stats ().nanoseconds[which],
+               std::chrono::duration_cast<std::chrono::nanoseconds>
+                 (std::chrono::steady_clock::now () - start).count ());
+    }
+
+  private:
+    statistics::phase which;
+    std::chrono::steady_clock::time_point start {};
+  };
+
+  inline void
+  print_statistics (std::ostream &output)
+  {
+    static const char *const names[statistics::phase_count] {
+      "mkdir", "realpath", "expansion", "rendering", "locking", "writing"
+    };
+
+    const statistics &s = stats ();
+    char line[64];
+
+    for (std::size_t i = 0; i < statistics::phase_count; ++i)
+      {
+        std::snprintf (line, sizeof (line), "%-20s %12.3f ms\n", names[i],
+                       s.nanoseconds[i].load () / 1e6);
+        output << line;
+      }
+
+    output << "bytes written        " << s.bytes_written.load () << '\n'
+           << "templates expanded   " << s.templates_expanded.load () << '\n'
+           << "variable lookups     " << s.variable_lookups.load () << '\n';
+  }
+
+  // 64-bit FNV-1a, to notice when generated files change
+  inline std::uint64_t
+  hash_bytes (const char *data,
+              std::size_t size,
+              std::uint64_t hash = 14695981039346656037ull)
+    noexcept
+  {
+    for (std::size_t i = 0; i < size; ++i)
+      {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ull;
+      }
+
+    return hash;
+  }
+
+  // Reads a whole file.  Returns false if it does not exist.
+  inline bool
+  read_file (const std::string &path,
+             std::string &contents)
+  {
+    int fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+      {
+        if (errno == ENOENT)
+          return false;
+
+        throw system_failure ("Opening", path, errno);
+      }
+
+    contents.clear ();
+    char block[8192];
+    ssize_t got;
+
+    while ((got = read (fd, block, sizeof (block))) != 0)
+      if (got > 0)
+        contents.append (block, got);
+      else if (errno != EINTR)
+        {
+          int saved = errno;
+          close (fd);
+          throw system_failure ("Reading", path, saved);
+        }
+
+    close (fd);
+    return true;
+  }
+
+  // The umask of the process.  Reading it means setting it, so this is
+  // done once, on first use; cenv_main calls it before any threads start.
+  inline mode_t
+  process_umask ()
+  {
+    static const mode_t mask = []
+      {
+        mode_t old = umask (0);
+        umask (old);
+        return old;
+      } ();
+
+    return mask;
+  }
+
+  // Writes a file under a temporary name and renames it over path, so
+  // that readers see either the old or the new contents, never a part.
+  // mkstemp creates the file private; it gets mode less the umask, as a
+  // file created with open would.
+  inline void
+  replace_file (const std::string &path,
+                const std::string &contents,
+                mode_t mode = 0644)
+  {
+    std::string temp {path + ".XXXXXX"};
+    int fd = mkstemp (&temp[0]);
+
+    if (fd < 0)
+      throw system_failure ("Creating", temp, errno);
+
+    const char *p = contents.data ();
+    std::size_t left = contents.size ();
+    int error = fchmod (fd, mode & ~process_umask ()) ? errno : 0;
+
+    while (!error && left)
+      {
+        ssize_t written = write (fd, p, left);
+
+        if (written >= 0)
+          {
+            p += written;
+            left -= written;
+          }
+        else if (errno != EINTR)
+          error = errno;
+      }
+
+    if (close (fd) && !error)
+      error = errno;
+
+    if (!error && rename (temp.c_str (), path.c_str ()))
+      error = errno;
+
+    if (error)
+      {
+        unlink (temp.c_str ());
+        throw system_failure ("Writing", path, error);
+      }
+
+    count (stats ().bytes_written, contents.size ());
+  }
+
+  inline void
+  write_json_string (std::ostream &output,
+                     const std::string &str)
+  {
+    static const char hex[] = "0123456789abcdef";
+
+    output << '"';
+
+    for (char ch : str)
+      switch (ch)
+        {
+        case '"':
+          output << "\\\"";
+          break;
+
+        case '\\':
+          output << "\\\\";
+          break;
+
+        case '\n':
+          output << "\\n";
+          break;
+
+        case '\t':
+          output << "\\t";
+          break;
+
+        default:
+          if ((unsigned char) ch < 0x20)
+            output << "\\u00" << hex[(ch >> 4) & 0xf] << hex[ch & 0xf];
+          else
+            output << ch;
+          break;
+        }
+
+    output << '"';
+  }
+
+  // A string map that remembers insertion order.  Iterating it goes
+  // in the order the keys were first added, so whatever is written from
+  // it comes out the same every time.
+  class variable_map final
+  {
+  public:
+    using value_type = std::pair<std::string, std::string>;
+    using const_iterator = std::vector<value_type>::const_iterator;
+
+    // A new key goes at the end; an old key keeps its place
+    std::string &
+    operator[] (const std::string &key)
+    {
+      auto found = index.emplace (key, items.size ());
+
+      if (found.second)
+        items.emplace_back (key, std::string {});
+
+      return items[found.first->second].second;
+    }
+
+    const_iterator
+    find (const std::string &key)
+      const
+    {
+      auto itr = index.find (key);
+
+      if (itr == index.cend ())
+        return items.cend ();
+      else
+        return items.cbegin () + itr->second;
+    }
+
+    const_iterator
+    begin ()
+      const
+      noexcept
+    {
+      return items.cbegin ();
+    }
+
+    const_iterator
+    end ()
+      const
+      noexcept
+    {
+      return items.cend ();
+    }
+
+    const_iterator
+    cbegin ()
+      const
+      noexcept
+    {
+      return items.cbegin ();
+    }
+
+    const_iterator
+    cend ()
+      const
+      noexcept
+    {
+      return items.cend ();
+    }
+
+    std::size_t
+    size ()
+      const
+      noexcept
+    {
+      return items.size ();
+    }
+
+    bool
+    empty ()
+      const
+      noexcept
+    {
+      return items.empty ();
+    }
+
+  private:
+    std::vector<value_type> items {};
+    std::unordered_map<std::string, std::size_t> index {};
+  };
+
+  inline const std::string &
+  lookup_variable (const variable_map &variables,
+                   const std::string &key)
+  {
+    count (stats ().variable_lookups);
+
+    auto itr = variables.find (key);
+
+    if (itr != variables.cend ())
+      return itr->second;
+    else
+      {
+        std::ostringstream msg_builder;
+        msg_builder << "Unknown variable: " << key;
+        throw syntax_exception {msg_builder.str ()};
+      }
+  }
+
+  constexpr std::size_t max_substitution_depth {1024};
+
+  // The variable syntax automaton.  The handler receives literal text
+  // with literal (), and push () / pop () around every variable name;
+  // pop () is where the name gets resolved.
+  template <typename Handler>
+  class substitution_parser final
+  {
+  public:
+    substitution_parser (Handler &handler)
+      noexcept
+      : handler (handler)
+    {
+    }
+
+    void
+    feed (const char *begin,
+          const char *end)
+    {
+      while (begin != end)
+        {
+          if (depth == 0 && !after_dollar)
+            {
+              // Outside of a variable everything up to the next dollar
+              // sign is literal, so copy it in one go.
+              const char *dollar = static_cast<const char *>
+                (std::memchr (begin, '$', end - begin));
+
+              if (!dollar)
+                {
+                  handler.literal (begin, end);
+                  break;
+                }
+
+              handler.literal (begin, dollar);
+              begin = dollar + 1;
+              after_dollar = true;
+              continue;
+            }
+
+          char ch = *begin++;
+
+          switch (ch)
+            {
+            case '$':
+              if (after_dollar)
+                {
+                  after_dollar = false;
+                  handler.literal (begin - 1, begin);
+                  break;
+                }
+
+              if (is_unbraced ())
+                pop ();
+
+              after_dollar = true;
+              break;
+
+            case '{':
+              if (after_dollar)
+                {
+                  after_dollar = false;
+                  push (true);
+                  break;
+                }
+
+              if (is_unbraced ())
+                pop ();
+
+              handler.literal (begin - 1, begin);
+              break;
+
+            case '}':
+              if (is_braced () && !after_dollar)
+                {
+                  pop ();
+                  break;
+                }
+
+              after_dollar = false;
+              handler.literal (begin - 1, begin);
+              break;
+
+            default:
+              if (is_unbraced ())
+                {
+                  pop ();
+                  break;
+                }
+
+              if (after_dollar)
+                {
+                  std::ostringstream msg_builder;
+                  msg_builder << "Invalid variable start character: " << ch;
+                  throw syntax_exception {msg_builder.str ()};
+                }
+
+              [[fallthrough]];
+
+            case '_': case 'a': case 'b': case 'c': case 'd': case 'e':
+            case 'f': case 'g': case 'h': case 'i': case 'j': case 'k':
+            case 'l': case 'm': case 'n': case 'o': case 'p': case 'q':
+            case 'r': case 's': case 't': case 'u': case 'v': case 'w':
+            case 'x': case 'y': case 'z': case 'A': case 'B': case 'C':
+            case 'D': case 'E': case 'F': case 'G': case 'H': case 'I':
+            case 'J': case 'K': case 'L': case 'M': case 'N': case 'O':
+            case 'P': case 'Q': case 'R': case 'S': case 'T': case 'U':
+            case 'V': case 'W': case 'X': case 'Y': case 'Z': case '0':
+            case '1': case '2': case '3': case '4': case '5': case '6':
+            case '7': case '8': case '9':
+              if (after_dollar)
+                push (false);
+
+              handler.literal (begin - 1, begin);
+              break;
+            }
+        }
+    }
+
+    void
+    finish ()
+    {
+      while (depth != 0)
+        if (braced[depth - 1])
+          throw syntax_exception {"Unterminated braced variable"};
+        else
+          pop ();
+    }
+
+  private:
+    Handler &handler;
+    bool after_dollar {false};
+    std::size_t depth {0};
+    std::bitset<max_substitution_depth> braced {};
+
+    bool
+    is_braced ()
+      const noexcept
+    {
+      return depth != 0 && braced[depth - 1];
+    }
+
+    bool
+    is_unbraced ()
+      const noexcept
+    {
+      return depth != 0 && !braced[depth - 1];
+    }
+
+    void
+    push (bool is_braced)
+    {
+      if (depth >= max_substitution_depth)
+        throw syntax_exception {"Recursion depth limit exceeded in variable"};
+
+      braced[depth++] = is_braced;
+      handler.push ();
+    }
+
+    void
+    pop ()
+    {
+      assert (depth != 0);
+
+      --depth;
+      handler.pop ();
+    }
+  };
+
+  // Expands variables straight into an output, anything with
+  // append (begin, end).  The names of the variables being expanded are
+  // collected in a single arena, so nesting does not allocate per level.
+  // Text reaches the output in pieces of the input or of the variable
+  // values, never of the arena.
+  template <typename Output>
+  class basic_substitution final
+  {
+  public:
+    basic_substitution (const variable_map &variables,
+                        Output &output)
+      noexcept
+      : variables {variables}, output {output}
+    {
+    }
+
+    void
+    literal (const char *begin,
+             const char *end)
+    {
+      if (depth != 0)
+        arena.append (begin, end);
+      else
+        output.append (begin, end);
+    }
+
+    void
+    push ()
+      noexcept
+    {
+      assert (depth < frames.size ());
+
+      frames[depth++] = arena.size ();
+    }
+
+    void
+    pop ()
+    {
+      assert (depth != 0);
+
+      std::size_t start = frames[--depth];
+      key.assign (arena, start, std::string::npos);
+      arena.resize (start);
+
+      const std::string &value = lookup_variable (variables, key);
+      literal (value.data (), value.data () + value.size ());
+    }
+
+  private:
+    const variable_map &variables;
+    Output &output;
+    std::string arena {};
+    std::string key {};
+    std::size_t depth {0};
+    std::array<std::size_t, max_substitution_depth> frames;
+  };
+
+  using substitution = basic_substitution<std::string>;
+
+  // Writes into a buffer of a fixed size and counts what does not fit,
+  // so that its owner learns the size it would need
+  class buffer_writer final
+  {
+  public:
+    buffer_writer (char *buffer,
+                   std::size_t capacity)
+      noexcept
+      : buffer {buffer}, capacity {capacity}
+    {
+    }
+
+    void
+    append (const char *begin,
+            const char *end)
+      noexcept
+    {
+      const std::size_t length = end - begin;
+
+      if (written < capacity)
+        std::memcpy (buffer + written, begin,
+                     std::min (length, capacity - written));
+
+      written += length;
+    }
+
+    std::size_t
+    size ()
+      const
+      noexcept
+    {
+      return written;
+    }
+
+  private:
+    char *buffer;
+    std::size_t capacity;
+    std::size_t written {0};
+  };
+
+  // A buffer_writer for the writers of the output formats, which take
+  // streams
+  class buffer_streambuf final : public std::streambuf
+  {
+  public:
+    buffer_streambuf (char *buffer,
+                      std::size_t capacity)
+      noexcept
+      : writer {buffer, capacity}
+    {
+    }
+
+    std::size_t
+    size ()
+      const
+      noexcept
+    {
+      return writer.size ();
+    }
+
+  protected:
+    std::streamsize
+    xsputn (const char *str,
+            std::streamsize count)
+      override
+    {
+      writer.append (str, str + count);
+      return count;
+    }
+
+    int_type
+    overflow (int_type ch)
+      override
+    {
+      if (!traits_type::eq_int_type (ch, traits_type::eof ()))
+        {
+          const char c = traits_type::to_char_type (ch);
+          writer.append (&c, &c + 1);
+        }
+
+      return traits_type::not_eof (ch);
+    }
+
+  private:
+    buffer_writer writer;
+  };
+
+  // Gathers output as pieces of memory, which have to stay put until
+  // flush (), and writes them to a file descriptor with writev
+  class vectored_writer final
+  {
+  public:
+    explicit vectored_writer (int fd)
+      noexcept
+      : fd {fd}
+    {
+    }
+
+    void
+    append (const char *begin,
+            const char *end)
+    {
+      if (begin == end)
+        return;
+
+      if (count != 0
+          && static_cast<const char *> (pieces[count - 1].iov_base)
+               + pieces[count - 1].iov_len == begin)
+        {
+          pieces[count - 1].iov_len += end - begin;
+          return;
+        }
+
+      if (count == pieces.size ())
+        flush ();
+
+      pieces[count].iov_base = const_cast<char *> (begin);
+      pieces[count].iov_len = end - begin;
+      ++count;
+    }
+
+    void
+    flush ()
+    {
+      struct iovec *next = pieces.data ();
+      int left = count;
+
+      while (left != 0)
+        {
+          ssize_t written = writev (fd, next, left);
+
+          if (written < 0)
+            {
+              if (errno == EINTR)
+                continue;
+
+              throw system_failure ("Writing", "the output", errno);
+            }
+
+          // Skip what went out, which may end inside a piece
+          while (left != 0 && (std::size_t) written >= next->iov_len)
+            {
+              written -= next->iov_len;
+              ++next;
+              --left;
+            }
+
+          if (left != 0)
+            {
+              next->iov_base = static_cast<char *> (next->iov_base) + written;
+              next->iov_len -= written;
+            }
+        }
+
+      count = 0;
+    }
+
+  private:
+    int fd;
+    std::array<struct iovec, 1024> pieces;
+    std::size_t count {0};
+  };
+
+  inline void
+  substitute_vars (const char *begin,
+                   const char *end,
+                   std::string &output,
+                   const variable_map &variables)
+  {
+    substitution engine {variables, output};
+    substitution_parser<substitution> parser {engine};
+    parser.feed (begin, end);
+    parser.finish ();
+  }
+
+  inline void
+  substitute_vars (std::istream &input,
+                   std::ostream &output,
+                   const variable_map &variables)
+  {
+    std::string buffer;
+    substitution engine {variables, buffer};
+    substitution_parser<substitution> parser {engine};
+    char block[8192];
+
+    while (input.read (block, sizeof (block)) || input.gcount ())
+      {
+        parser.feed (block, block + input.gcount ());
+        output.write (buffer.data (), buffer.size ());
+        buffer.clear ();
+      }
+
+    parser.finish ();
+    output.write (buffer.data (), buffer.size ());
+  }
+
+  // Substitutes one file descriptor into another.  A regular file is
+  // mapped from its current offset and fed in one go, leaving the
+  // offset at the end as a read would; anything else is read in large
+  // blocks.  Either way the output is written straight from the input
+  // and the variable values.
+  inline void
+  substitute_vars (int input,
+                   int output,
+                   const variable_map &variables)
+  {
+    vectored_writer writer {output};
+    basic_substitution<vectored_writer> engine {variables, writer};
+    substitution_parser<basic_substitution<vectored_writer>> parser
+      {engine};
+    struct stat st;
+    off_t start;
+
+    if (!fstat (input, &st) && S_ISREG (st.st_mode)
+        && (start = lseek (input, 0, SEEK_CUR)) >= 0
+        && start < st.st_size)
+      {
+        // mmap wants a page-aligned offset; skip the rest of the page
+        off_t page = sysconf (_SC_PAGESIZE);
+        off_t base = start - start % page;
+        size_t length = st.st_size - base;
+        void *data = mmap (nullptr, length, PROT_READ, MAP_PRIVATE,
+                           input, base);
+
+        if (data != MAP_FAILED)
+          {
+            const char *begin = static_cast<const char *> (data);
+            madvise (data, length, MADV_SEQUENTIAL);
+
+            try
+              {
+                parser.feed (begin + (start - base), begin + length);
+                parser.finish ();
+                writer.flush ();
+              }
+            catch (...)
+              {
+                munmap (data, length);
+                throw;
+              }
+
+            munmap (data, length);
+            lseek (input, st.st_size, SEEK_SET);
+            return;
+          }
+      }
+
+    std::vector<char> block (1 << 20);
+    ssize_t got;
+
+    while ((got = read (input, block.data (), block.size ())) != 0)
+      {
+        if (got < 0)
+          {
+            if (errno == EINTR)
+              continue;
+
+            throw system_failure ("Reading", "the input", errno);
+          }
+
+        parser.feed (block.data (), block.data () + got);
+
+        // The pieces point into the block, which the next read reuses
+        writer.flush ();
+      }
+
+    parser.finish ();
+    writer.flush ();
+  }
+
+  // A template parsed ahead of time.  Nested names are kept flat:
+  // nested_begin starts collecting a name and nested_end resolves it.
+  struct template_token
+  {
+    enum class kind
+    {
+      literal,
+      variable,
+      nested_begin,
+      nested_end
+    };
+
+    kind type;
+    std::string text;
+  };
+
+  class template_compiler final
+  {
+  public:
+    template_compiler (std::vector<template_token> &tokens)
+      noexcept
+      : tokens (tokens)
+    {
+    }
+
+    void
+    literal (const char *begin,
+             const char *end)
+    {
+      if (!tokens.empty ()
+          && tokens.back ().type == template_token::kind::literal)
+        tokens.back ().text.append (begin, end);
+      else
+        tokens.push_back ({template_token::kind::literal, {begin, end}});
+    }
+
+    void
+    push ()
+    {
+      opened.push_back (tokens.size ());
+      tokens.push_back ({template_token::kind::nested_begin, {}});
+    }
+
+    void
+    pop ()
+    {
+      assert (!opened.empty ());
+
+      std::size_t start = opened.back ();
+      opened.pop_back ();
+
+      // A name without inner variables is a plain variable reference
+      switch (tokens.size () - start)
+        {
+        case 1:
+          tokens.back () = {template_token::kind::variable, {}};
+          break;
+
+        case 2:
+          if (tokens.back ().type == template_token::kind::literal)
+            {
+              tokens[start] = {template_token::kind::variable,
+                               std::move (tokens.back ().text)};
+              tokens.pop_back ();
+              break;
+            }
+
+          [[fallthrough]];
+
+        default:
+          tokens.push_back ({template_token::kind::nested_end, {}});
+          break;
+        }
+    }
+
+  private:
+    std::vector<template_token> &tokens;
+    std::vector<std::size_t> opened {};
+  };
+
+  class compiled_template final
+  {
+  public:
+    compiled_template (const char *begin,
+                       const char *end)
+    {
+      template_compiler compiler {tokens};
+      substitution_parser<template_compiler> parser {compiler};
+      parser.feed (begin, end);
+      parser.finish ();
+    }
+
+    compiled_template (const std::string &source)
+      : compiled_template (source.data (), source.data () + source.size ())
+    {
+    }
+
+    void
+    expand (const variable_map &variables,
+            std::string &output)
+      const
+    {
+      // Nested names are built at the end of the output and replaced
+      // with their values once complete.
+      std::vector<std::size_t> names;
+      std::string name;
+
+      for (const auto &token : tokens)
+        switch (token.type)
+          {
+          case template_token::kind::literal:
+            output.append (token.text);
+            break;
+
+          case template_token::kind::variable:
+            output.append (lookup_variable (variables, token.text));
+            break;
+
+          case template_token::kind::nested_begin:
+            names.push_back (output.size ());
+            break;
+
+          case template_token::kind::nested_end:
+            {
+              assert (!names.empty ());
+
+              name.assign (output, names.back (), std::string::npos);
+              output.erase (names.back ());
+              names.pop_back ();
+              output.append (lookup_variable (variables, name));
+              break;
+            }
+          }
+    }
+
+    // Whether the expansion can change with the variable.  A nested
+    // name could end up as any variable.
+    bool
+    refers_to (const std::string &name)
+      const
+      noexcept
+    {
+      for (const auto &token : tokens)
+        if (token.type == template_token::kind::nested_begin
+            || (token.type == template_token::kind::variable
+                && token.text == name))
+          return true;
+
+      return false;
+    }
+
+  private:
+    std::vector<template_token> tokens {};
+  };
+
+  // Compiles every distinct template once and remembers its expansion.
+  class template_cache final
+  {
+  public:
+    const std::string &
+    expand (const std::string &source,
+            const variable_map &variables)
+    {
+      auto itr = entries.find (source);
+
+      if (itr == entries.end ())
+        {
+          entry e {source, {}};
+          e.compiled.expand (variables, e.expanded);
+          count (stats ().templates_expanded);
+          itr = entries.emplace (source, std::move (e)).first;
+        }
+
+      return itr->second.expanded;
+    }
+
+    // Expands the templates that refer to the variable again, after it
+    // changed in variables.  The others keep their expansion.
+    void
+    refresh (const std::string &name,
+             const variable_map &variables)
+    {
+      for (auto &e : entries)
+        if (e.second.compiled.refers_to (name))
+          {
+            e.second.expanded.clear ();
+            e.second.compiled.expand (variables, e.second.expanded);
+            count (stats ().templates_expanded);
+          }
+    }
+
+    void
+    clear ()
+      noexcept
+    {
+      entries.clear ();
+    }
+
+  private:
+    struct entry
+    {
+      compiled_template compiled;
+      std::string expanded;
+    };
+
+    std::unordered_map<std::string, entry> entries {};
+  };
+
+  // An environment with every template expanded and every directory
+  // resolved, ready to be written out in any format
+  struct resolved_variable
+  {
+    enum class kind
+    {
+      // value goes in front of the prompt
+      prompt,
+      // entries go in front of the variable, separated with colons
+      search,
+      // value replaces the variable
+      literal
+    };
+
+    kind type;
+    std::string name;
+    std::vector<std::string> entries;
+    std::string value;
+
+    // The entries joined with colons
+    std::string
+    joined ()
+      const
+    {
+      std::string result;
+
+      for (const auto &entry : entries)
+        {
+          if (!result.empty ())
+            result.push_back (':');
+
+          result.append (entry);
+        }
+
+      return result;
+    }
+  };
+
+  struct resolved_environment
+  {
+    std::string root;
+
+    // The scripts remember which environment is active, so that sourcing
+    // them again does nothing: the folder, with :<triple> after it for
+    // the scripts of a -T variant
+    std::string folder;
+    std::vector<resolved_variable> variables;
+
+    // Save the variables in one block, see config::snapshot_variables
+    bool snapshot_variables;
+
+    // The folder, if the scripts should find it from where they are
+    // instead, see config::relocatable
+    std::string relocatable_base;
+
+    // The directories LD_LIBRARY_PATH would have held, when the compiler
+    // launchers put them in the binaries instead, see
+    // config::compiler_launchers
+    std::vector<std::string> run_path;
+  };
+
+  // The length of base if str has it as a whole path at pos, 0 if not
+  inline std::size_t
+  match_path (const std::string &str,
+              std::size_t pos,
+              const std::string &base)
+    noexcept
+  {
+    if (base.empty () || str.compare (pos, base.size (), base))
+      return 0;
+
+    std::size_t end = pos + base.size ();
+
+    if (end != str.size () && !std::strchr ("/: ", str[end]))
+      return 0;
+
+    return base.size ();
+  }
+
+  // str with every whole path below from moved below to
+  inline std::string
+  rewrite_paths (const std::string &str,
+                 const std::string &from,
+                 const std::string &to)
+  {
+    std::string result;
+
+    for (std::size_t i = 0; i < str.size ();)
+      if (std::size_t len = match_path (str, i, from))
+        {
+          result.append (to);
+          i += len;
+        }
+      else
+        result.push_back (str[i++]);
+
+    return result;
+  }
+
+  // Writes str so that it can go between double quotes in sh.  Paths
+  // below base refer to it through ${__CENV_DIR} instead.
+  inline void
+  write_sh_double_quoted (std::ostream &output,
+                          const std::string &str,
+                          const std::string &base = {})
+  {
+    for (std::size_t i = 0; i < str.size ();)
+      {
+        if (std::size_t len = match_path (str, i, base))
+          {
+            output << "${__CENV_DIR}";
+            i += len;
+            continue;
+          }
+
+        char ch = str[i++];
+
+        if (ch == '"' || ch == '$' || ch == '`' || ch == '\\')
+          output << '\\';
+
+        output << ch;
+      }
+  }
+
+  inline void
+  write_sh_single_quoted (std::ostream &output,
+                          const std::string &str)
+  {
+    output << '\'';
+
+    for (char ch : str)
+      if (ch == '\'')
+        output << "'\\''";
+      else
+        output << ch;
+
+    output << '\'';
+  }
+
+  // Writes a shell function, fallback, that runs the next program of
+  // that name in PATH with its arguments, skipping the directory in
+  // $self.  Scripts in .cenv/bin that stand in for a program use it.
+  // With skip_state, every directory below $state is skipped instead,
+  // for the launchers of -T variants, which have those of the plain
+  // environment after them in PATH.
+  inline void
+  write_sh_fallback (std::ostream &output,
+                     const char *program,
+                     bool skip_state = false)
+  {
+    output << "# Runs the next " << program << " in PATH\n"
+              "fallback () {\n"
+              "  path=$PATH\n"
+              "  while [ -n \"$path\" ]; do\n"
+              "    dir=${path%%:*}\n"
+              "    case $path in\n"
+              "      *:*) path=${path#*:} ;;\n"
+              "      *) path= ;;\n"
+              "    esac\n";
+
+    if (skip_state)
+      output << "    case ${dir:-.} in\n"
+                "      \"$state\"/*) continue ;;\n"
+                "    esac\n"
+                "    if [ -x \"${dir:-.}/" << program << "\" ]; then\n";
+    else
+      output << "    if [ \"${dir:-.}\" != \"$self\" ] "
+                "&& [ -x \"${dir:-.}/" << program << "\" ]; then\n";
+
+    output << "      exec \"${dir:-.}/" << program << "\" \"$@\"\n"
+              "    fi\n"
+              "  done\n"
+              "  echo \"" << program << ": not found\" >&2\n"
+              "  exit 127\n"
+              "}\n";
+  }
+
+  // The fish flavour: quoted strings with $__cenv_dir in between them
+  inline void
+  write_fish_quoted (std::ostream &output,
+                     const std::string &str,
+                     const std::string &base = {})
+  {
+    output << '\'';
+
+    for (std::size_t i = 0; i < str.size ();)
+      {
+        if (std::size_t len = match_path (str, i, base))
+          {
+            output << "'$__cenv_dir'";
+            i += len;
+            continue;
+          }
+
+        char ch = str[i++];
+
+        if (ch == '\'' || ch == '\\')
+          output << '\\';
+
+        output << ch;
+      }
+
+    output << '\'';
+  }
+
+  // Sourcing the script again would save the variables it set as the
+  // originals, so it stops when the folder is already active.  Another
+  // active environment is deactivated first for the same reason.
+  inline void
+  write_sh_guard (const resolved_environment &env,
+                  std::ostream &output)
+  {
+    const std::string &base = env.relocatable_base;
+
+    output << "if [ -n \"${__CENV_ACTIVE-}\" ]; then\n"
+              "  if [ \"$__CENV_ACTIVE\" = \"";
+    write_sh_double_quoted (output, env.folder, base);
+    output << "\" ]; then\n";
+
+    if (!base.empty ())
+      output << "    unset __CENV_DIR\n";
+
+    output << "    return 0\n"
+              "  fi\n"
+              "  deactivate\n"
+              "fi\n";
+  }
+
+  inline void
+  write_sh_profile_start (const char *indent,
+                          std::ostream &output)
+  {
+    output << indent
+           << "__CENV_PROFILE_START=${CENV_PROFILE:+${EPOCHREALTIME-}}\n";
+  }
+
+  // With CENV_PROFILE naming a file, activate and deactivate append a
+  // line to it with how long they took in microseconds, if the shell
+  // has EPOCHREALTIME.  It takes no subshells either.
+  inline void
+  write_sh_profiler (const char *shell,
+                     std::ostream &output)
+  {
+    write_sh_profile_start ("", output);
+    output << "# Args: $1 - what took the time since __CENV_PROFILE_START\n"
+              "__cenv_profile () {\n"
+              "  __CENV_PROFILE_END=$EPOCHREALTIME\n"
+              "  printf '%s %s %s %s\\n' \"$1\" " << shell
+           << " \"$__CENV_ACTIVE\" \\\n"
+              "    $(( ${__CENV_PROFILE_END%[!0-9]*}"
+              "${__CENV_PROFILE_END#*[!0-9]} \\\n"
+              "      - ${__CENV_PROFILE_START%[!0-9]*}"
+              "${__CENV_PROFILE_START#*[!0-9]} )) >> \"$CENV_PROFILE\"\n"
+              "  unset __CENV_PROFILE_END\n"
+              "}\n";
+  }
+
+  // Ends what write_sh_profiler started, in activate or deactivate
+  inline void
+  write_sh_profile_end (const char *what,
+                        const char *indent,
+                        std::ostream &output)
+  {
+    output << indent << "if [ -n \"$__CENV_PROFILE_START\" ]; then\n"
+           << indent << "  __cenv_profile " << what << '\n'
+           << indent << "fi\n"
+           << indent << "unset __CENV_PROFILE_START\n";
+  }
+
+  inline void
+  write_bash_script (const resolved_environment &env,
+                     std::ostream &output)
+  {
+    output << "# Activate script generated by cenv\n"
+              "# Use the . command in the shell, do not run this script\n"
+              "\n";
+
+    const std::string &base = env.relocatable_base;
+
+    if (!base.empty ())
+      output << "# The folder is wherever this script is\n"
+                "case ${BASH_SOURCE[0]} in\n"
+                "  */*) __CENV_DIR=${BASH_SOURCE[0]%/*} ;;\n"
+                "  *) __CENV_DIR=. ;;\n"
+                "esac\n"
+                "case $__CENV_DIR in\n"
+                "  /*) ;;\n"
+                "  .) __CENV_DIR=$PWD ;;\n"
+                "  *) __CENV_DIR=$PWD/$__CENV_DIR ;;\n"
+                "esac\n";
+
+    write_sh_guard (env, output);
+    write_sh_profiler ("bash", output);
+
+    // Prepending drops the entries from the old value first, with
+    // expansions instead of subshells.  A value that is set but empty
+    // still leaves its colon.
+    output << "# Args: $1 - variable name, $2... - entries\n"
+              "__cenv_prepend () {\n"
+              "  local __cenv_name=$1 __cenv_value __cenv_entry __cenv_rest\n"
+              "  shift\n"
+              "  if [ -n \"${!__cenv_name:+x}\" ]; then\n"
+              "    __cenv_value=\":${!__cenv_name}:\"\n"
+              "    for __cenv_entry; do\n"
+              "      while "
+              "__cenv_rest=${__cenv_value//\":$__cenv_entry:\"/:}\n"
+              "            [ \"$__cenv_rest\" != \"$__cenv_value\" ]; do\n"
+              "        __cenv_value=$__cenv_rest\n"
+              "      done\n"
+              "    done\n"
+              "    __cenv_value=${__cenv_value%:}\n"
+              "  else\n"
+              "    __cenv_value=${!__cenv_name+:}\n"
+              "  fi\n"
+              "  local IFS=:\n"
+              "  printf -v \"$__cenv_name\" \"%s\" \"$*$__cenv_value\"\n"
+              "}\n";
+
+    if (env.snapshot_variables)
+      {
+        // Save all the variables in a single block of shell code that
+        // deactivate evaluates.  ${var@Q} needs bash 4.4.
+        output << "deactivate () {\n";
+        write_sh_profile_start ("  ", output);
+        output << "  eval \"$__CENV_SAVED\"\n";
+        write_sh_profile_end ("deactivate", "  ", output);
+        output << "  unset __CENV_SAVED __CENV_ACTIVE\n"
+                  "}\n"
+                  "__CENV_SAVED=\"unset";
+
+        for (const auto &var : env.variables)
+          output << ' ' << var.name;
+
+        output << ';';
+
+        for (const auto &var : env.variables)
+          {
+            output << "${" << var.name << "+ " << var.name << "=${"
+                   << var.name << "@Q};";
+
+            if (var.type != resolved_variable::kind::prompt)
+              output << " export " << var.name << ';';
+
+            output << '}';
+          }
+
+        output << "\"\n";
+      }
+    else
+      {
+        output << "# Args: $1 - variable name\n"
+                  "__cenv_defined () {\n"
+                  "  ! [ \"x${!1+x}\" = x ]\n"
+                  "}\n"
+                  "# Args: $1 - variable name\n"
+                  "__cenv_savevar () {\n"
+                  "  if __cenv_defined \"$1\"; then\n"
+                  "    printf -v __CENV_$1_DEFINED yes\n"
+                  "    printf -v __CENV_$1_ORIG \"%s\" \"${!1}\"\n"
+                  "  fi\n"
+                  "}\n"
+                  "# Args: $1 - variable name\n"
+                  "__cenv_restorevar () {\n"
+                  "  printf -v __CENV_TMP \"__CENV_%s_DEFINED\" \"$1\"\n"
+                  "  if [ \"x${!__CENV_TMP}\" = xyes ]; then\n"
+                  "    printf -v __CENV_TMP \"__CENV_%s_ORIG\" \"$1\"\n"
+                  "    printf -v $1 \"%s\" \"${!__CENV_TMP}\"\n"
+                  "    export $1\n"
+                  "  else\n"
+                  "    unset $1\n"
+                  "  fi\n"
+                  "  unset __CENV_TMP\n"
+                  "  unset __CENV_$1_DEFINED\n"
+                  "  unset __CENV_$1_ORIG\n"
+                  "}\n"
+                  "deactivate () {\n";
+        write_sh_profile_start ("  ", output);
+
+        for (const auto &var : env.variables)
+          output << "  __cenv_restorevar " << var.name << '\n';
+
+        write_sh_profile_end ("deactivate", "  ", output);
+        output << "  unset __CENV_ACTIVE\n"
+                  "}\n";
+      }
+
+    for (const auto &var : env.variables)
+      {
+        if (!env.snapshot_variables)
+          output << "__cenv_savevar " << var.name << '\n';
+
+        switch (var.type)
+          {
+          case resolved_variable::kind::prompt:
+            output << var.name << "=\"";
+            write_sh_double_quoted (output, var.value, base);
+            output << "${" << var.name << "}\"\n";
+            continue;
+
+          case resolved_variable::kind::search:
+            // One assignment per variable, the shell would otherwise copy
+            // the growing value once for every entry.
+            output << "__cenv_prepend " << var.name;
+
+            for (const auto &entry : var.entries)
+              {
+                output << " \"";
+                write_sh_double_quoted (output, entry, base);
+                output << '"';
+              }
+
+            output << '\n';
+            break;
+
+          case resolved_variable::kind::literal:
+            output << var.name << "=\"";
+            write_sh_double_quoted (output, var.value, base);
+            output << "\"\n";
+            break;
+          }
+
+        output << "export " << var.name << '\n';
+      }
+
+    output << "unset -f __cenv_prepend\n"
+              "__CENV_ACTIVE=\"";
+    write_sh_double_quoted (output, env.folder, base);
+    output << "\"\n";
+    write_sh_profile_end ("activate", "", output);
+
+    if (!base.empty ())
+      output << "unset __CENV_DIR\n";
+  }
+
+  // Defines __cenv_strip for write_sh_script and write_hook_script.
+  // No ${var//pattern/} here, so the entries are cut out one match at a
+  // time.  The old value comes with a colon in front when it is set.
+  inline void
+  write_sh_strip (std::ostream &output)
+  {
+    output << "# Args: $1 - old value, $2... - entries\n"
+              "__cenv_strip () {\n"
+              "  __cenv_value=$1\n"
+              "  shift\n"
+              "  case $__cenv_value in\n"
+              "    ''|:) return ;;\n"
+              "  esac\n"
+              "  __cenv_value=$__cenv_value:\n"
+              "  for __cenv_entry; do\n"
+              "    while :; do\n"
+              "      case $__cenv_value in\n"
+              "        *\":$__cenv_entry:\"*) ;;\n"
+              "        *) break ;;\n"
+              "      esac\n"
+              "      __cenv_value=${__cenv_value%%\":$__cenv_entry:\"*}:"
+              "${__cenv_value#*\":$__cenv_entry:\"}\n"
+              "    done\n"
+              "  done\n"
+              "  __cenv_value=${__cenv_value%:}\n"
+              "}\n";
+  }
+
+  // Defines deactivate for write_sh_script and, with the state of the
+  // hook, for write_hook_script
+  inline void
+  write_sh_deactivate (const resolved_environment &env,
+                       bool hook,
+                       std::ostream &output)
+  {
+    output << "deactivate () {\n";
+    write_sh_profile_start ("  ", output);
+
+    for (const auto &var : env.variables)
+      {
+        output << "  if [ -n \"${__CENV_" << var.name << "_DEFINED-}\" ]; "
+                  "then\n"
+                  "    " << var.name << "=$__CENV_" << var.name << "_ORIG\n";
+
+        if (var.type != resolved_variable::kind::prompt)
+          output << "    export " << var.name << '\n';
+
+        output << "  else\n"
+                  "    unset " << var.name << "\n"
+                  "  fi\n"
+                  "  unset __CENV_" << var.name << "_DEFINED __CENV_"
+               << var.name << "_ORIG\n";
+      }
+
+    write_sh_profile_end ("deactivate", "  ", output);
+    output << "  unset __CENV_ACTIVE\n";
+
+    if (hook)
+      output << "  unset __CENV_HOOK __CENV_HOOK_NAMES\n";
+
+    output << "}\n";
+  }
+
+  // Like the bash script, but only with what dash and other POSIX
+  // shells have
+  inline void
+  write_sh_script (const resolved_environment &env,
+                   std::ostream &output)
+  {
+    output << "# Activate script generated by cenv\n"
+              "# Use the . command in the shell, do not run this script\n"
+              "\n";
+
+    // A POSIX shell cannot tell which file it is reading
+    const std::string &base = env.relocatable_base;
+
+    if (!base.empty ())
+      {
+        output << "# Set CENV_DIR when the folder has moved\n"
+                  "__CENV_DIR=${CENV_DIR:-\"";
+        write_sh_double_quoted (output, base);
+        output << "\"}\n";
+      }
+
+    write_sh_guard (env, output);
+    write_sh_profiler ("sh", output);
+
+    write_sh_strip (output);
+    write_sh_deactivate (env, false, output);
+
+    for (const auto &var : env.variables)
+      {
+        output << "if [ -n \"${" << var.name << "+x}\" ]; then\n"
+                  "  __CENV_" << var.name << "_DEFINED=yes\n"
+                  "  __CENV_" << var.name << "_ORIG=$" << var.name << "\n"
+                  "fi\n";
+
+        switch (var.type)
+          {
+          case resolved_variable::kind::prompt:
+            output << var.name << "=\"";
+            write_sh_double_quoted (output, var.value, base);
+            output << "${" << var.name << "-}\"\n";
+            continue;
+
+          case resolved_variable::kind::search:
+            output << "__cenv_strip \"${" << var.name << "+:$" << var.name
+                   << "}\"";
+
+            for (const auto &entry : var.entries)
+              {
+                output << " \"";
+                write_sh_double_quoted (output, entry, base);
+                output << '"';
+              }
+
+            output << '\n' << var.name << "=\"";
+            write_sh_double_quoted (output, var.joined (), base);
+            output << "$__cenv_value\"\n";
+            break;
+
+          case resolved_variable::kind::literal:
+            output << var.name << "=\"";
+            write_sh_double_quoted (output, var.value, base);
+            output << "\"\n";
+            break;
+          }
+
+        output << "export " << var.name << '\n';
+      }
+
+    output << "unset __cenv_value __cenv_entry\n"
+              "unset -f __cenv_strip\n"
+              "__CENV_ACTIVE=\"";
+    write_sh_double_quoted (output, env.folder, base);
+    output << "\"\n";
+    write_sh_profile_end ("activate", "", output);
+
+    if (!base.empty ())
+      output << "unset __CENV_DIR\n";
+  }
+
+  // A script for cd and prompt hooks of POSIX shells, which keeps the
+  // environment applied.  It returns at once while the stamp the shell
+  // has is that of this script and the environment is still active.
+  // Otherwise it works out the variables again from the originals saved
+  // when it first ran and only assigns those that differ, so that the
+  // shell does not drop its command hash for a PATH that stays the same.
+  // Whatever the last version set and this one does not goes back.
+  inline void
+  write_hook_script (const resolved_environment &env,
+                     std::ostream &output)
+  {
+    const std::string &base = env.relocatable_base;
+    std::string names;
+
+    for (const auto &var : env.variables)
+      names.append (names.empty () ? "" : " ").append (var.name);
+
+    std::ostringstream body;
+
+    write_sh_profiler ("sh", body);
+    write_sh_strip (body);
+
+    // Start over from what another environment, or this one from its
+    // activate script, left
+    body << "if [ \"${__CENV_ACTIVE-}\" != \"";
+    write_sh_double_quoted (body, env.folder, base);
+    body << "\" ] || [ -z \"${__CENV_HOOK+x}\" ]; then\n"
+            "  if [ -n \"${__CENV_ACTIVE-}\" ]; then\n"
+            "    deactivate\n"
+            "  fi\n"
+            "  __CENV_HOOK_NAMES=\n"
+            "fi\n"
+            "for __cenv_name in $__CENV_HOOK_NAMES; do\n"
+            "  case \" " << names << " \" in\n"
+            "    *\" $__cenv_name \"*) ;;\n"
+            "    *)\n"
+            "      eval \"__cenv_defined="
+            "\\${__CENV_${__cenv_name}_DEFINED-}\"\n"
+            "      if [ -n \"$__cenv_defined\" ]; then\n"
+            "        eval \"$__cenv_name=\\$__CENV_${__cenv_name}_ORIG\"\n"
+            "      else\n"
+            "        unset \"$__cenv_name\"\n"
+            "      fi\n"
+            "      unset \"__CENV_${__cenv_name}_DEFINED\" "
+            "\"__CENV_${__cenv_name}_ORIG\"\n"
+            "      ;;\n"
+            "  esac\n"
+            "done\n";
+
+    for (const auto &var : env.variables)
+      {
+        const std::string orig {"__CENV_" + var.name + "_ORIG"};
+
+        body << "case \" $__CENV_HOOK_NAMES \" in\n"
+                "  *\" " << var.name << " \"*) ;;\n"
+                "  *)\n"
+                "    if [ -n \"${" << var.name << "+x}\" ]; then\n"
+                "      __CENV_" << var.name << "_DEFINED=yes\n"
+                "      " << orig << "=$" << var.name << "\n"
+                "    fi\n"
+                "    ;;\n"
+                "esac\n";
+
+        switch (var.type)
+          {
+          case resolved_variable::kind::prompt:
+            body << "__cenv_value=\"";
+            write_sh_double_quoted (body, var.value, base);
+            body << "${" << orig << "-}\"\n";
+            break;
+
+          case resolved_variable::kind::search:
+            body << "__cenv_strip \"${" << orig << "+:$" << orig << "}\"";
+
+            for (const auto &entry : var.entries)
+              {
+                body << " \"";
+                write_sh_double_quoted (body, entry, base);
+                body << '"';
+              }
+
+            body << "\n"
+                    "__cenv_value=\"";
+            write_sh_double_quoted (body, var.joined (), base);
+            body << "$__cenv_value\"\n";
+            break;
+
+          case resolved_variable::kind::literal:
+            body << "__cenv_value=\"";
+            write_sh_double_quoted (body, var.value, base);
+            body << "\"\n";
+            break;
+          }
+
+        body << "if [ -z \"${" << var.name << "+x}\" ] || [ \"$" << var.name
+             << "\" != \"$__cenv_value\" ]; then\n"
+                "  " << var.name << "=$__cenv_value\n";
+
+        if (var.type != resolved_variable::kind::prompt)
+          body << "  export " << var.name << '\n';
+
+        body << "fi\n";
+      }
+
+    body << "unset __cenv_value __cenv_entry __cenv_name __cenv_defined\n"
+            "unset -f __cenv_strip\n";
+    write_sh_deactivate (env, true, body);
+    body << "__CENV_HOOK_NAMES='" << names << "'\n"
+            "__CENV_ACTIVE=\"";
+    write_sh_double_quoted (body, env.folder, base);
+    body << "\"\n";
+
+    const std::string text {body.str ()};
+    char stamp[17];
+    std::snprintf (stamp, sizeof (stamp), "%016llx",
+                   (unsigned long long) hash_bytes (text.data (),
+                                                    text.size ()));
+
+    output << "# Hook script generated by cenv\n"
+              "# Use the . command from a cd or prompt hook of the shell\n"
+              "\n";
+
+    if (!base.empty ())
+      {
+        output << "# Set CENV_DIR when the folder has moved\n"
+                  "__CENV_DIR=${CENV_DIR:-\"";
+        write_sh_double_quoted (output, base);
+        output << "\"}\n";
+      }
+
+    output << "if [ \"${__CENV_HOOK-}\" = " << stamp
+           << " ] && [ \"${__CENV_ACTIVE-}\" = \"";
+    write_sh_double_quoted (output, env.folder, base);
+    output << "\" ]; then\n";
+
+    if (!base.empty ())
+      output << "  unset __CENV_DIR\n";
+
+    output << "  return 0\n"
+              "fi\n"
+           << text
+           << "__CENV_HOOK=" << stamp << '\n';
+    write_sh_profile_end ("hook", "", output);
+
+    if (!base.empty ())
+      output << "unset __CENV_DIR\n";
+  }
+
+  // fish has no PS1, the prompt goes in front of fish_prompt instead
+  inline void
+  write_fish_script (const resolved_environment &env,
+                     std::ostream &output)
+  {
+    output << "# Activate script generated by cenv\n"
+              "# Use the source command in fish, do not run this script\n"
+              "\n";
+
+    const std::string &base = env.relocatable_base;
+
+    if (!base.empty ())
+      output << "# The folder is wherever this script is\n"
+                "set -l __cenv_dir (builtin realpath (status dirname))\n";
+
+    // See write_sh_guard
+    output << "if set -q __cenv_active\n"
+              "  if test \"$__cenv_active\" = ";
+    write_fish_quoted (output, env.folder, base);
+    output << "\n"
+              "    return 0\n"
+              "  end\n"
+              "  deactivate\n"
+              "end\n"
+              "function deactivate\n";
+
+    for (const auto &var : env.variables)
+      {
+        if (var.type == resolved_variable::kind::prompt)
+          {
+            output << "  functions -e fish_prompt\n"
+                      "  if functions -q __cenv_fish_prompt\n"
+                      "    functions -c __cenv_fish_prompt fish_prompt\n"
+                      "    functions -e __cenv_fish_prompt\n"
+                      "  end\n";
+            continue;
+          }
+
+        output << "  if set -q __cenv_" << var.name << "_defined\n"
+                  "    set -gx " << var.name << " $__cenv_" << var.name
+               << "_orig\n"
+                  "  else\n"
+                  "    set -e " << var.name << "\n"
+                  "  end\n"
+                  "  set -e __cenv_" << var.name << "_defined\n"
+                  "  set -e __cenv_" << var.name << "_orig\n";
+      }
+
+    output << "  set -e __cenv_active\n"
+              "  functions -e deactivate\n"
+              "end\n";
+
+    for (const auto &var : env.variables)
+      switch (var.type)
+        {
+        case resolved_variable::kind::prompt:
+          output << "if functions -q fish_prompt\n"
+                    "  functions -c fish_prompt __cenv_fish_prompt\n"
+                    "end\n"
+                    "function fish_prompt\n"
+                    "  printf '%s' ";
+          write_fish_quoted (output, var.value, base);
+          output << "\n"
+                    "  if functions -q __cenv_fish_prompt\n"
+                    "    __cenv_fish_prompt\n"
+                    "  end\n"
+                    "end\n";
+          break;
+
+        case resolved_variable::kind::search:
+        case resolved_variable::kind::literal:
+          output << "if set -q " << var.name << "\n"
+                    "  set -g __cenv_" << var.name << "_defined\n"
+                    "  set -g __cenv_" << var.name << "_orig $" << var.name
+                 << "\n"
+                    "end\n";
+
+          if (var.type == resolved_variable::kind::search)
+            {
+              // Every search variable ends in PATH, which fish keeps as a
+              // list, so the old entries are filtered with contains
+              const auto entries = [&] ()
+                {
+                  for (const auto &entry : var.entries)
+                    {
+                      output << ' ';
+                      write_fish_quoted (output, entry, base);
+                    }
+                };
+
+              output << "set -l __cenv_rest\n"
+                        "for __cenv_entry in $" << var.name << "\n"
+                        "  if not contains -- $__cenv_entry";
+              entries ();
+              output << "\n"
+                        "    set -a __cenv_rest $__cenv_entry\n"
+                        "  end\n"
+                        "end\n"
+                        "set -gx " << var.name;
+              entries ();
+              output << " $__cenv_rest";
+            }
+          else
+            {
+              output << "set -gx " << var.name << ' ';
+              write_fish_quoted (output, var.value, base);
+            }
+
+          output << '\n';
+          break;
+        }
+
+    output << "set -g __cenv_active ";
+    write_fish_quoted (output, env.folder, base);
+    output << '\n';
+  }
+
+  // KEY=VALUE lines, for tools that read environment files.  A search
+  // variable only holds the entries of the environment.
+  inline void
+  write_env_file (const resolved_environment &env,
+                  std::ostream &output)
+  {
+    for (const auto &var : env.variables)
+      switch (var.type)
+        {
+        case resolved_variable::kind::prompt:
+          break;
+
+        case resolved_variable::kind::search:
+          output << var.name << '=' << var.joined () << '\n';
+          break;
+
+        case resolved_variable::kind::literal:
+          output << var.name << '=' << var.value << '\n';
+          break;
+        }
+  }
+
+  inline void
+  write_json (const resolved_environment &env,
+              std::ostream &output)
+  {
+    static const char *const kinds[] {"prompt", "search", "literal"};
+
+    output << "{\n"
+              "  \"root\": ";
+    write_json_string (output, env.root);
+    output << ",\n"
+              "  \"variables\": [";
+
+    bool first = true;
+    for (const auto &var : env.variables)
+      {
+        output << (first ? "\n" : ",\n") << "    {\"name\": ";
+        first = false;
+
+        write_json_string (output, var.name);
+        output << ", \"type\": \"" << kinds[(int) var.type] << '"';
+
+        if (var.type == resolved_variable::kind::search)
+          {
+            output << ", \"entries\": [";
+
+            for (std::size_t i = 0; i < var.entries.size (); ++i)
+              {
+                if (i)
+                  output << ", ";
+
+                write_json_string (output, var.entries[i]);
+              }
+
+            output << ']';
+          }
+        else
+          {
+            output << ", \"value\": ";
+            write_json_string (output, var.value);
+          }
+
+        output << '}';
+      }
+
+    output << "\n"
+              "  ]\n"
+              "}\n";
+  }
+
+  // The include directories in the compile_flags.txt clangd reads, one
+  // argument per line: those of C++ first, then the others of C
+  inline void
+  write_compile_flags (const resolved_environment &env,
+                       std::ostream &output)
+  {
+    std::vector<const std::string *> dirs;
+
+    for (const char *name : {"CPLUS_INCLUDE_PATH", "C_INCLUDE_PATH"})
+      for (const auto &var : env.variables)
+        if (var.type == resolved_variable::kind::search && var.name == name)
+          for (const auto &entry : var.entries)
+            if (std::find_if (dirs.cbegin (), dirs.cend (),
+                              [&] (const std::string *dir) -> bool {
+                                return *dir == entry;
+                              }) == dirs.cend ())
+              dirs.push_back (&entry);
+
+    for (const auto *dir : dirs)
+      output << "-isystem\n" << *dir << '\n';
+  }
+
+  struct output_format
+  {
+    const char *name;
+    // Relative to the folder
+    const char *file;
+    void (*write) (const resolved_environment &, std::ostream &);
+  };
+
+  // The bash script comes first and is always written
+  inline const std::array<output_format, 7> &
+  output_formats ()
+    noexcept
+  {
+    static const std::array<output_format, 7> table {{
+      {"bash", "activate", write_bash_script},
+      {"sh", "activate.sh", write_sh_script},
+      {"fish", "activate.fish", write_fish_script},
+      {"env", "cenv.env", write_env_file},
+      {"json", "cenv.json", write_json},
+      {"compile-flags", "compile_flags.txt", write_compile_flags},
+      {"hook", "cenv-hook.sh", write_hook_script}
+    }};
+
+    return table;
+  }
+
+  // A compiler cache that -C can point at a directory of the
+  // environment
+  struct compiler_cache
+  {
+    const char *name;
+    // Where the cache keeps its objects
+    const char *dir_variable;
+    // Makes absolute paths below the root relative in the hashes, if the
+    // cache supports it
+    const char *basedir_variable;
+    // Mixed into every hash, if the cache supports it
+    const char *salt_variable;
+  };
+
+  inline const compiler_cache *
+  find_compiler_cache (const std::string &name)
+    noexcept
+  {
+    static const std::array<compiler_cache, 2> table {{
+      {"ccache", "CCACHE_DIR", "CCACHE_BASEDIR", nullptr},
+      {"sccache", "SCCACHE_DIR", nullptr, "SCCACHE_C_CUSTOM_CACHE_BUSTER"}
+    }};
+
+    for (const auto &cache : table)
+      if (name == cache.name)
+        return &cache;
+
+    return nullptr;
+  }
+
+  struct config;
+
+  inline void
+  load_manifest (const std::string &folder,
+                 config &cfg);
+
+  struct config
+  {
+    variable_map variables {};
+
+    std::string folder;
+    std::string prompt;
+    bool prompt_set {false};
+    std::string root;
+    bool root_set {false};
+
+    std::vector<std::string> executable_suffixes {};
+    std::vector<std::string> include_suffixes {};
+    std::vector<std::string> info_suffixes {};
+    std::vector<std::string> library_suffixes {};
+    std::vector<std::string> manpage_suffixes {};
+    std::vector<std::string> pkg_config_suffixes {};
+
+    variable_map environment_variables {};
+
+    // Save the variables for deactivate in one block instead of one
+    // pair of __CENV_*_ORIG variables each
+    bool snapshot_variables {false};
+
+    // Leave out the directories that do not exist
+    bool prune_missing {false};
+
+    // Let the scripts find the folder from where they are, so that it
+    // can be moved or copied
+    bool relocatable {false};
+
+    // Which of output_formats () to write besides the bash script, one
+    // bit each
+    unsigned formats {0};
+
+    // The name of a compiler cache from find_compiler_cache to set up,
+    // or empty
+    std::string compiler_cache {};
+
+    // Environments this one goes on top of, the lowest first.  Their
+    // saved configs are resolved along with this one, see resolve.
+    std::vector<std::string> bases {};
+
+    // More values of mach_type to write the outputs for, next to the
+    // plain ones, see create_environment
+    std::vector<std::string> mach_types {};
+
+    // Create the directories of the suffix lists while creating the
+    // environment, see make_layout.  This one is not saved.
+    bool make_layout {false};
+
+    // Write cc and c++ launchers into .cenv/bin that link with a run path
+    // to the library directories, which leaves LD_LIBRARY_PATH and
+    // DYLD_LIBRARY_PATH out of the scripts, see add_compiler_launchers
+    bool compiler_launchers {false};
+
+    // The mach_type of the -T variant being written, whose launchers go
+    // in .cenv/<triple>.  This one is not saved.
+    std::string variant {};
+
+    mutable template_cache templates {};
+
+    // Each suffix list holds the suffixes in the order they are searched.
+    // Options add theirs at the back, defaults go in front of them.
+    static void
+    add_suffix (std::vector<std::string> &suffixes,
+                std::string suffix)
+    {
+      suffixes.push_back (std::move (suffix));
+    }
+
+    static void
+    add_default_suffix (std::vector<std::string> &suffixes,
+                        std::string suffix)
+    {
+      suffixes.insert (suffixes.begin (), std::move (suffix));
+    }
+
+    void
+    add_default_configs ()
+    {
+      if (!prompt_set)
+        {
+          std::ostringstream prompt_builder;
+
+          prompt_builder << '('
+            << (folder.c_str () + folder.find_last_of ('/') + 1)
+            << ") ";
+
+          prompt = prompt_builder.str ();
+        }
+
+      if (!root_set)
+        root = folder;
+
+      // Without -D mach_type the first -T is the one for the plain
+      // outputs
+      if (!mach_types.empty ()
+          && variables.find ("mach_type") == variables.cend ())
+        variables["mach_type"] = mach_types.front ();
+
+      add_default_suffix (executable_suffixes, "bin");
+
+      add_default_suffix (include_suffixes, "include");
+      if (variables.find ("mach_type") != variables.cend ())
+        add_default_suffix (include_suffixes, "include/${mach_type}");
+
+      add_default_suffix (info_suffixes, "share/info");
+
+      add_default_suffix (library_suffixes, "lib");
+      if (variables.find ("mach_type") != variables.cend ())
+        add_default_suffix (library_suffixes, "lib/${mach_type}");
+      // Some x86_64-specific stuff
+      if (variables.find ("mach_x32") != variables.cend ())
+        add_default_suffix (library_suffixes, "libx32");
+      if (variables.find ("mach_32") != variables.cend ())
+        add_default_suffix (library_suffixes, "lib32");
+      if (variables.find ("mach_64") != variables.cend ())
+        add_default_suffix (library_suffixes, "lib64");
+
+      add_default_suffix (manpage_suffixes, "man");
+      add_default_suffix (manpage_suffixes, "share/man");
+
+      add_default_suffix (pkg_config_suffixes, "lib/pkgconfig");
+      add_default_suffix (pkg_config_suffixes, "share/pkgconfig");
+      if (variables.find ("mach_type") != variables.cend ())
+        add_default_suffix (pkg_config_suffixes,
+                            "lib/${mach_type}/pkgconfig");
+    }
+
+    // Expansions are cached, so variables must not change once the
+    // first template has been expanded.
+    const std::string &
+    expand (const std::string &str)
+      const
+    {
+      return templates.expand (str, variables);
+    }
+
+    struct search_variable
+    {
+      const char *name;
+      const std::vector<std::string> config::*suffixes;
+      // The index in .cenv that replaces the directories, if any
+      const char *index;
+      // A directory in .cenv that goes in front of them, if any
+      const char *front;
+    };
+
+    // Every search path variable, in the order they are set
+    static const std::array<search_variable, 9> &
+    search_variables ()
+      noexcept
+    {
+      static const std::array<search_variable, 9> table {{
+        {"PATH", &config::executable_suffixes, nullptr, "bin"},
+        {"C_INCLUDE_PATH", &config::include_suffixes, "include", nullptr},
+        {"CPLUS_INCLUDE_PATH", &config::include_suffixes, "include",
+         nullptr},
+        {"INFOPATH", &config::info_suffixes, nullptr, nullptr},
+        {"LIBRARY_PATH", &config::library_suffixes, nullptr, nullptr},
+        {"LD_LIBRARY_PATH", &config::library_suffixes, "lib", nullptr},
+        {"DYLD_LIBRARY_PATH", &config::library_suffixes, "lib", nullptr},
+        {"MANPATH", &config::manpage_suffixes, nullptr, nullptr},
+        {"PKG_CONFIG_PATH", &config::pkg_config_suffixes, nullptr, nullptr}
+      }};
+
+      return table;
+    }
+
+    // The directories that end up in front of a search path variable,
+    // in their final order
+    std::vector<std::string>
+    search_directories (const std::vector<std::string> &suffixes)
+      const
+    {
+      std::vector<std::string> dirs;
+      std::string dir;
+      struct stat st;
+
+      for (const auto &suffix : suffixes)
+        {
+          dir.assign (root).append ("/").append (expand (suffix));
+
+          if (prune_missing
+              && (stat (dir.c_str (), &st) || !S_ISDIR (st.st_mode)))
+            continue;
+
+          dirs.push_back (dir);
+        }
+
+      return dirs;
+    }
+
+    // Where the cenv index-* modes put their indexes: lib for the
+    // shared libraries, include and include.yaml for the headers
+    std::string
+    index_path (const char *name)
+      const
+    {
+      return folder + "/.cenv/" + name;
+    }
+
+    // Where add_compiler_launchers puts its files: in .cenv, or in
+    // .cenv/<triple> for a -T variant, whose compilers see other
+    // directories
+    std::string
+    launcher_path (const char *name)
+      const
+    {
+      if (variant.empty ())
+        return index_path (name);
+
+      return folder + "/.cenv/" + variant + '/' + name;
+    }
+
+    // Variables cenv sets by itself, alongside environment_variables
+    std::vector<std::pair<std::string, std::string>>
+    generated_variables ()
+      const
+    {
+      std::vector<std::pair<std::string, std::string>> result;
+      const std::string overlay {index_path ("include.yaml")};
+
+      if (!access (overlay.c_str (), F_OK))
+        result.emplace_back ("CENV_CLANG_FLAGS", "-ivfsoverlay " + overlay);
+
+      return result;
+    }
+
+    // Puts the variables of a base under the ones already there.  The
+    // entries of a search variable go after the ones it has, unless it
+    // has them already; anything else only fills in what is missing.
+    static void
+    merge_base (std::vector<resolved_variable> &variables,
+                std::vector<resolved_variable> base)
+    {
+      for (auto &var : base)
+        {
+          if (var.type == resolved_variable::kind::prompt)
+            continue;
+
+          auto it = std::find_if (variables.begin (), variables.end (),
+                                  [&] (const resolved_variable &v) {
+                                    return v.name == var.name;
+                                  });
+
+          if (it == variables.end ())
+            variables.push_back (std::move (var));
+          else if (it->type == resolved_variable::kind::search
+                   && var.type == resolved_variable::kind::search)
+            for (auto &entry : var.entries)
+              if (std::find (it->entries.cbegin (), it->entries.cend (),
+                             entry) == it->entries.cend ())
+                it->entries.push_back (std::move (entry));
+        }
+    }
+
+    // Expands and resolves everything once.  The library variables
+    // share a suffix list, which is resolved once.  Variables with an
+    // index only get the index once it exists, and the same goes for
+    // directories in front.
+    resolved_environment
+    resolve ()
+      const
+    {
+      phase_timer timer {statistics::expand};
+      resolved_environment env {root, folder, {}, snapshot_variables, {},
+                                {}};
+
+      if (relocatable)
+        env.relocatable_base = folder;
+
+      std::vector<std::string> chain;
+      env.variables = resolve_layers (chain);
+
+      const std::string print {fingerprint (env)};
+      env.variables.push_back ({resolved_variable::kind::literal,
+                                "CENV_FINGERPRINT", {}, print});
+
+      if (const auto *cache = find_compiler_cache (compiler_cache))
+        {
+          const auto literal = [&] (const char *name,
+                                    std::string value) -> void {
+            env.variables.push_back ({resolved_variable::kind::literal,
+                                      name, {}, std::move (value)});
+          };
+
+          literal (cache->dir_variable, index_path (cache->name));
+
+          if (cache->basedir_variable)
+            literal (cache->basedir_variable, root);
+
+          if (cache->salt_variable)
+            literal (cache->salt_variable, print);
+
+          literal ("CMAKE_C_COMPILER_LAUNCHER", cache->name);
+          literal ("CMAKE_CXX_COMPILER_LAUNCHER", cache->name);
+        }
+
+      // After the fingerprint, the run path still changes what a build
+      // makes
+      if (compiler_launchers)
+        {
+          auto &vars = env.variables;
+
+          for (auto itr = vars.begin (); itr != vars.end ();)
+            if (itr->name == "LD_LIBRARY_PATH")
+              {
+                env.run_path = std::move (itr->entries);
+                itr = vars.erase (itr);
+              }
+            else if (itr->name == "DYLD_LIBRARY_PATH")
+              itr = vars.erase (itr);
+            else
+              ++itr;
+        }
+
+      return env;
+    }
+
+    // The variables of this environment with those of its bases merged
+    // in, the nearest base first.  chain holds the folders being
+    // resolved, to catch an environment that ends up on top of itself.
+    // The fingerprint and the compiler cache belong to the top one.
+    std::vector<resolved_variable>
+    resolve_layers (std::vector<std::string> &chain)
+      const
+    {
+      std::vector<resolved_variable> variables;
+
+      variables.push_back ({resolved_variable::kind::prompt, "PS1", {},
+                            expand (prompt)});
+
+      const std::vector<std::string> config::*last {nullptr};
+      std::vector<std::string> dirs;
+      const char *last_index {nullptr};
+      std::string index;
+      bool indexed {false};
+
+      for (const auto &var : search_variables ())
+        {
+          if (var.index && var.index != last_index)
+            {
+              struct stat st;
+
+              last_index = var.index;
+              index = index_path (var.index);
+              indexed = !stat (index.c_str (), &st) && S_ISDIR (st.st_mode);
+            }
+
+          if (var.index && indexed)
+            {
+              variables.push_back ({resolved_variable::kind::search,
+                                    var.name, {index}, {}});
+              continue;
+            }
+
+          if (var.suffixes != last)
+            {
+              last = var.suffixes;
+              dirs = search_directories (this->*var.suffixes);
+            }
+
+          std::vector<std::string> entries {dirs};
+
+          if (var.front)
+            {
+              struct stat st;
+              std::string front {index_path (var.front)};
+
+              if (!stat (front.c_str (), &st) && S_ISDIR (st.st_mode))
+                entries.insert (entries.begin (), std::move (front));
+
+              // The launchers of a -T variant go in front of those
+              if (compiler_launchers && !variant.empty ())
+                {
+                  std::string own {launcher_path (var.front)};
+
+                  if (!stat (own.c_str (), &st) && S_ISDIR (st.st_mode))
+                    entries.insert (entries.begin (), std::move (own));
+                }
+            }
+
+          if (!entries.empty ())
+            variables.push_back ({resolved_variable::kind::search,
+                                  var.name, std::move (entries), {}});
+        }
+
+      for (auto &e : generated_variables ())
+        variables.push_back ({resolved_variable::kind::literal,
+                              std::move (e.first), {},
+                              std::move (e.second)});
+
+      for (const auto &e : environment_variables)
+        variables.push_back ({resolved_variable::kind::literal, e.first, {},
+                              expand (e.second)});
+
+      chain.push_back (folder);
+
+      for (auto base = bases.crbegin (); base != bases.crend (); ++base)
+        {
+          if (std::find (chain.cbegin (), chain.cend (), *base)
+              != chain.cend ())
+            throw environment_exception {*base + " is a base of itself"};
+
+          config cfg;
+          load_manifest (*base, cfg);
+          merge_base (variables, cfg.resolve_layers (chain));
+        }
+
+      chain.pop_back ();
+      return variables;
+    }
+
+    // A hash of the variables a compile can see, as 16 hex digits.  The
+    // folder and the root are left out of it, so that the same
+    // environment created somewhere else gets the same fingerprint.
+    std::string
+    fingerprint (const resolved_environment &env)
+      const
+    {
+      std::uint64_t hash = hash_bytes (nullptr, 0);
+      std::string text;
+
+      const auto add = [&] (const std::string &value) -> void {
+        text.clear ();
+
+        for (std::size_t i = 0; i < value.size ();)
+          if (!root.empty () && !value.compare (i, root.size (), root))
+            {
+              text.append ("\1R");
+              i += root.size ();
+            }
+          else if (!folder.empty ()
+                   && !value.compare (i, folder.size (), folder))
+            {
+              text.append ("\1F");
+              i += folder.size ();
+            }
+          else
+            text.push_back (value[i++]);
+
+        hash = hash_bytes (text.c_str (), text.size () + 1, hash);
+      };
+
+      for (const auto &var : env.variables)
+        {
+          if (var.type == resolved_variable::kind::prompt)
+            continue;
+
+          hash = hash_bytes (var.name.c_str (), var.name.size () + 1, hash);
+
+          if (var.type == resolved_variable::kind::search)
+            for (const auto &entry : var.entries)
+              add (entry);
+          else
+            add (var.value);
+
+          hash = hash_bytes ("\2", 1, hash);
+        }
+
+      char text_hash[17];
+      std::snprintf (text_hash, sizeof (text_hash), "%016llx",
+                     (unsigned long long) hash);
+      return text_hash;
+    }
+
+    void
+    write_activate_script (std::ostream &output)
+      const
+    {
+      write_bash_script (resolve (), output);
+    }
+  };
+
+  // The file of an output for a -T variant, activate-<triple>.sh for
+  // activate.sh
+  inline std::string
+  variant_file (const char *file,
+                const std::string &mach_type)
+  {
+    const char *dot = std::strchr (file, '.');
+    std::string result {file, dot ? dot : file + std::strlen (file)};
+
+    return result.append ("-").append (mach_type).append (dot ? dot : "");
+  }
+
+  // Resolves the folder of an existing environment and fills in the
+  // defaults.
+  inline void
+  open_environment (config &cfg,
+                    bool default_configs)
+  {
+    phase_timer timer {statistics::resolve_paths};
+    char *folder_res = realpath (cfg.folder.c_str (), nullptr);
+
+    if (!folder_res)
+      throw system_failure ("Resolving the directory", cfg.folder, errno);
+
+    cfg.folder = folder_res;
+    free (folder_res);
+
+    // Bases and triples given twice only count once, where they first
+    // appear
+    std::vector<std::string> bases;
+
+    for (const auto &base : cfg.bases)
+      {
+        char *base_res = realpath (base.c_str (), nullptr);
+
+        if (!base_res)
+          throw system_failure ("Resolving the directory", base, errno);
+
+        if (std::find (bases.cbegin (), bases.cend (), base_res)
+            == bases.cend ())
+          bases.emplace_back (base_res);
+
+        free (base_res);
+      }
+
+    cfg.bases = std::move (bases);
+
+    std::vector<std::string> mach_types;
+
+    for (auto &mach_type : cfg.mach_types)
+      if (std::find (mach_types.cbegin (), mach_types.cend (), mach_type)
+          == mach_types.cend ())
+        mach_types.push_back (std::move (mach_type));
+
+    cfg.mach_types = std::move (mach_types);
+
+    if (default_configs)
+      cfg.add_default_configs ();
+  }
+
+  // The manifest keeps the settings of an environment, defaults
+  // included, in .cenv/manifest.  After a magic line it is a run of
+  // NUL-terminated fields, each a tag byte and a value.  The tags are
+  // the option letters: p and r for the prompt and the root, D and E
+  // for KEY=VAL variables, e, i, I, l, m and P for suffixes in search
+  // order, f for output formats, C for the compiler cache and s, x and
+  // R, without a value, for the flags.
+  constexpr char manifest_magic[] {"cenv-manifest-1\n"};
+
+  inline std::string
+  manifest_path (const std::string &folder)
+  {
+    return folder + "/.cenv/manifest";
+  }
+
+  inline std::string
+  encode_manifest (const config &cfg)
+  {
+    std::string out {manifest_magic};
+
+    const auto field = [&] (char tag,
+                            const std::string &value) -> void {
+      out.push_back (tag);
+      out.append (value).push_back ('\0');
+    };
+
+    field ('p', cfg.prompt);
+    field ('r', cfg.root);
+
+    for (const auto &var : cfg.variables)
+      field ('D', var.first + '=' + var.second);
+
+    const auto suffixes = [&] (char tag,
+                               const std::vector<std::string> &list)
+      -> void {
+      for (const auto &suffix : list)
+        field (tag, suffix);
+    };
+
+    suffixes ('e', cfg.executable_suffixes);
+    suffixes ('i', cfg.include_suffixes);
+    suffixes ('I', cfg.info_suffixes);
+    suffixes ('l', cfg.library_suffixes);
+    suffixes ('m', cfg.manpage_suffixes);
+    suffixes ('P', cfg.pkg_config_suffixes);
+
+    for (const auto &var : cfg.environment_variables)
+      field ('E', var.first + '=' + var.second);
+
+    const auto &formats = output_formats ();
+    for (std::size_t i = 1; i < formats.size (); ++i)
+      if (cfg.formats & (1u << i))
+        field ('f', formats[i].name);
+
+    if (!cfg.compiler_cache.empty ())
+      field ('C', cfg.compiler_cache);
+
+    for (const auto &base : cfg.bases)
+      field ('b', base);
+
+    for (const auto &mach_type : cfg.mach_types)
+      field ('T', mach_type);
+
+    if (cfg.compiler_launchers)
+      field ('L', {});
+
+    if (cfg.snapshot_variables)
+      field ('s', {});
+
+    if (cfg.prune_missing)
+      field ('x', {});
+
+    if (cfg.relocatable)
+      field ('R', {});
+
+    return out;
+  }
+
+  // Fills in cfg from the fields of a manifest.  Returns false if they
+  // do not make up one.
+  inline bool
+  decode_manifest (const char *begin,
+                   const char *end,
+                   config &cfg)
+  {
+    const std::size_t magic_size = sizeof (manifest_magic) - 1;
+
+    if ((std::size_t) (end - begin) < magic_size
+        || std::memcmp (begin, manifest_magic, magic_size))
+      return false;
+
+    const auto &formats = output_formats ();
+
+    for (const char *p = begin + magic_size; p != end;)
+      {
+        const char *nul
+          = static_cast<const char *> (std::memchr (p, '\0', end - p));
+
+        if (!nul || nul == p)
+          return false;
+
+        const char tag = *p;
+        const char *value = p + 1;
+        const char *eq;
+        p = nul + 1;
+
+        switch (tag)
+          {
+          case 'p':
+            cfg.prompt.assign (value, nul);
+            cfg.prompt_set = true;
+            break;
+
+          case 'r':
+            cfg.root.assign (value, nul);
+            cfg.root_set = true;
+            break;
+
+          case 'D':
+          case 'E':
+            eq = static_cast<const char *> (std::memchr (value, '=',
+                                                         nul - value));
+            if (!eq)
+              return false;
+
+            (tag == 'D' ? cfg.variables : cfg.environment_variables)
+              [std::string {value, eq}].assign (eq + 1, nul);
+            break;
+
+          case 'e':
+            cfg.executable_suffixes.emplace_back (value, nul);
+            break;
+
+          case 'i':
+            cfg.include_suffixes.emplace_back (value, nul);
+            break;
+
+          case 'I':
+            cfg.info_suffixes.emplace_back (value, nul);
+            break;
+
+          case 'l':
+            cfg.library_suffixes.emplace_back (value, nul);
+            break;
+
+          case 'm':
+            cfg.manpage_suffixes.emplace_back (value, nul);
+            break;
+
+          case 'P':
+            cfg.pkg_config_suffixes.emplace_back (value, nul);
+            break;
+
+          case 'f':
+            {
+              std::size_t i;
+
+              for (i = 1; i < formats.size (); ++i)
+                if (!std::strcmp (value, formats[i].name))
+                  break;
+
+              if (i == formats.size ())
+                return false;
+
+              cfg.formats |= 1u << i;
+              break;
+            }
+
+          case 'C':
+            cfg.compiler_cache.assign (value, nul);
+
+            if (!find_compiler_cache (cfg.compiler_cache))
+              return false;
+            break;
+
+          case 'b':
+            cfg.bases.emplace_back (value, nul);
+            break;
+
+          case 'T':
+            cfg.mach_types.emplace_back (value, nul);
+            break;
+
+          case 'L':
+            cfg.compiler_launchers = true;
+            break;
+
+          case 's':
+            cfg.snapshot_variables = true;
+            break;
+
+          case 'x':
+            cfg.prune_missing = true;
+            break;
+
+          case 'R':
+            cfg.relocatable = true;
+            break;
+
+          default:
+            return false;
+          }
+      }
+
+    return true;
+  }
+
+  // Loads the manifest of the folder into cfg.  The file is mapped and
+  // decoded in place.
+  inline void
+  load_manifest (const std::string &folder,
+                 config &cfg)
+  {
+    const std::string path {manifest_path (folder)};
+    int fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+      throw system_failure ("Opening", path, errno);
+
+    struct stat st;
+
+    if (fstat (fd, &st))
+      {
+        int saved = errno;
+        close (fd);
+        throw system_failure ("Reading", path, saved);
+      }
+
+    void *data = MAP_FAILED;
+
+    if (st.st_size > 0)
+      {
+        data = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data == MAP_FAILED)
+          {
+            int saved = errno;
+            close (fd);
+            throw system_failure ("Mapping", path, saved);
+          }
+      }
+
+    close (fd);
+
+    const char *begin = static_cast<const char *> (data);
+    bool ok = data != MAP_FAILED
+      && decode_manifest (begin, begin + st.st_size, cfg);
+
+    if (data != MAP_FAILED)
+      munmap (data, st.st_size);
+
+    if (!ok)
+      throw environment_exception {path + " is damaged"};
+
+    cfg.folder = folder;
+  }
+
+  // Creates the directories the suffix lists name below the root.  The
+  // root is looked up once and everything else is made with mkdirat
+  // relative to it.  Only the deepest directories are tried, and their
+  // parents only when they are missing, so an existing layout costs one
+  // call for each of those.  Returns how many directories were made.
+  inline std::size_t
+  make_layout (const config &cfg)
+  {
+    phase_timer timer {statistics::make_directories};
+    std::set<std::string> dirs;
+
+    for (const auto &var : config::search_variables ())
+      for (const auto &suffix : cfg.*var.suffixes)
+        {
+          const std::string &dir = cfg.expand (suffix);
+          std::size_t begin = dir.find_first_not_of ('/');
+          std::size_t end = dir.find_last_not_of ('/');
+
+          if (begin != std::string::npos)
+            dirs.insert (dir.substr (begin, end + 1 - begin));
+        }
+
+    int root = open (cfg.root.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (root < 0)
+      throw system_failure ("Opening", cfg.root, errno);
+
+    std::size_t made = 0;
+    std::string path;
+
+    const auto make = [&] (const std::string &dir) -> void {
+      std::size_t end = dir.size ();
+
+      // Go up until a directory can be made, then back down
+      for (;;)
+        {
+          path.assign (dir, 0, end);
+
+          if (!mkdirat (root, path.c_str (), 0755))
+            ++made;
+          else if (errno == ENOENT && path.find ('/') != std::string::npos)
+            {
+              end = path.find_last_of ('/');
+              continue;
+            }
+          else if (errno != EEXIST)
+            {
+              int saved = errno;
+              close (root);
+              throw system_failure ("Creating the directory",
+                                    cfg.root + '/' + path, saved);
+            }
+
+          if (end == dir.size ())
+            return;
+
+          end = dir.find ('/', end + 1);
+
+          if (end == std::string::npos)
+            end = dir.size ();
+        }
+    };
+
+    // Directories with others inside are made along with those
+    for (const auto &dir : dirs)
+      {
+        const std::string prefix {dir + '/'};
+        auto inner = dirs.lower_bound (prefix);
+
+        if (inner == dirs.cend ()
+            || inner->compare (0, prefix.size (), prefix))
+          make (dir);
+      }
+
+    close (root);
+    return made;
+  }
+
+  // Holds the lock of an environment, .cenv/lock, while it lives.
+  // Everything that writes to a folder takes it, so that cenv runs on
+  // the same folder take turns, whether they are threads, processes or
+  // NFS clients.
+  class environment_lock final
+  {
+  public:
+    explicit environment_lock (const std::string &folder)
+    {
+      phase_timer timer {statistics::lock};
+      const std::string path {folder + "/.cenv/lock"};
+      fd = open (path.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+      if (fd < 0)
+        throw system_failure ("Opening", path, errno);
+
+      while (flock (fd, LOCK_EX))
+        if (errno != EINTR)
+          {
+            int errno_save = errno;
+            close (fd);
+            throw system_failure ("Locking", path, errno_save);
+          }
+    }
+
+    environment_lock (const environment_lock &) = delete;
+    environment_lock &operator= (const environment_lock &) = delete;
+
+    ~environment_lock ()
+    {
+      close (fd);
+    }
+
+  private:
+    int fd;
+  };
+
+  // Where the hash of the generated files is kept
+  inline std::string
+  hash_path (const std::string &folder)
+  {
+    return folder + "/.cenv/hash";
+  }
+
+  // A file create_environment writes
+  struct generated_file
+  {
+    std::string path;
+    std::string contents;
+    mode_t mode;
+  };
+
+  // Adds an argument to a response file of gcc or clang, on a line of
+  // its own with blanks, quotes and backslashes escaped
+  inline void
+  append_response_argument (std::string &file,
+                            const std::string &arg)
+  {
+    for (char ch : arg)
+      {
+        if (std::strchr (" \t\n\r\f\v'\"\\", ch))
+          file.push_back ('\\');
+
+        file.push_back (ch);
+      }
+
+    file.push_back ('\n');
+  }
+
+  // Adds the compiler launchers to the files: .cenv/bin/cc and
+  // .cenv/bin/c++ run the next compiler of that name in PATH with the
+  // include directories of the environment as -isystem.  Links also get
+  // its library directories, with a run path, so that the binaries do
+  // not need LD_LIBRARY_PATH.  The flags are in response files in .cenv,
+  // and the scripts only look at the arguments, so they start nothing
+  // but the compiler.
+  inline void
+  add_compiler_launchers (const config &cfg,
+                          const resolved_environment &env,
+                          std::vector<generated_file> &files)
+  {
+    const auto entries = [&] (const char *name)
+      -> const std::vector<std::string> & {
+      static const std::vector<std::string> none;
+
+      for (const auto &var : env.variables)
+        if (var.type == resolved_variable::kind::search && var.name == name)
+          return var.entries;
+
+      return none;
+    };
+
+    const std::string bin {cfg.launcher_path ("bin")};
+    const std::string link_file {cfg.launcher_path ("link.rsp")};
+    std::string link;
+
+    for (const auto &dir : entries ("LIBRARY_PATH"))
+      append_response_argument (link, "-L" + dir);
+
+    // -Wl would split directories with commas in them
+    for (const auto &dir : env.run_path)
+      {
+        append_response_argument (link, "-Xlinker");
+        append_response_argument (link, "-rpath");
+        append_response_argument (link, "-Xlinker");
+        append_response_argument (link, dir);
+      }
+
+    // A run path instead of an rpath, which LD_LIBRARY_PATH can still
+    // override
+    if (!env.run_path.empty ())
+      append_response_argument (link, "-Wl,--enable-new-dtags");
+
+    files.push_back ({link_file, std::move (link), 0644});
+
+    const struct
+    {
+      const char *name;
+      const char *include_variable;
+    } compilers[] {
+      {"cc", "C_INCLUDE_PATH"},
+      {"c++", "CPLUS_INCLUDE_PATH"}
+    };
+
+    for (const auto &compiler : compilers)
+      {
+        const std::string flags_file
+          {cfg.launcher_path (compiler.name) + ".rsp"};
+        std::string flags;
+
+        for (const auto &dir : entries (compiler.include_variable))
+          {
+            append_response_argument (flags, "-isystem");
+            append_response_argument (flags, dir);
+          }
+
+        files.push_back ({flags_file, std::move (flags), 0644});
+
+        std::ostringstream script;
+
+        script << "#!/bin/sh\n"
+                  "# " << compiler.name << " launcher generated by cenv\n"
+                  "\n"
+                  "self=";
+        write_sh_single_quoted (script, bin);
+        script << '\n';
+
+        if (!cfg.variant.empty ())
+          {
+            script << "state=";
+            write_sh_single_quoted (script, cfg.folder + "/.cenv");
+            script << '\n';
+          }
+
+        script << '\n';
+        write_sh_fallback (script, compiler.name, !cfg.variant.empty ());
+        script << "\n"
+                  "# Only links need the library flags\n"
+                  "link=yes\n"
+                  "for arg do\n"
+                  "  case $arg in\n"
+                  "    -c|-S|-E|-M|-MM|-fsyntax-only) link= ;;\n"
+                  "  esac\n"
+                  "done\n"
+                  "\n"
+                  "if [ -n \"$link\" ]; then\n"
+                  "  set -- ";
+        write_sh_single_quoted (script, '@' + link_file);
+        script << " \"$@\"\n"
+                  "fi\n"
+                  "\n"
+                  "fallback ";
+        write_sh_single_quoted (script, '@' + flags_file);
+        script << " \"$@\"\n";
+
+        files.push_back ({bin + '/' + compiler.name, script.str (), 0755});
+      }
+  }
+
+  // Writes the files of the environment and its manifest.  When they
+  // would come out the same as last time, nothing is touched, so their
+  // mtimes stay put for build tools and file watchers; that includes
+  // waiting for another cenv writing the same environment.  Returns
+  // whether anything was written.
+  inline bool
+  create_environment (config &cfg,
+                      bool default_configs)
+  {
+    {
+      phase_timer timer {statistics::make_directories};
+
+      if (mkdir (cfg.folder.c_str (), 0755) && errno != EEXIST)
+        throw system_failure ("Creating the directory", cfg.folder, errno);
+    }
+
+    open_environment (cfg, default_configs);
+
+    // Before resolving, so that -x sees the new directories
+    if (cfg.make_layout)
+      make_layout (cfg);
+
+    const std::string state_path {cfg.folder + "/.cenv"};
+
+    {
+      phase_timer timer {statistics::make_directories};
+
+      if (mkdir (state_path.c_str (), 0755) && errno != EEXIST)
+        throw system_failure ("Creating the directory", state_path, errno);
+
+      // The launchers go there, and it must exist to go in PATH
+      const std::string bin {cfg.index_path ("bin")};
+
+      if (cfg.compiler_launchers && mkdir (bin.c_str (), 0755)
+          && errno != EEXIST)
+        throw system_failure ("Creating the directory", bin, errno);
+    }
+
+    const auto &formats = output_formats ();
+    std::vector<generated_file> files;
+
+    // Every format is written from the same expansion
+    const auto render = [&] (const resolved_environment &env,
+                             const std::string *mach_type) -> void {
+      phase_timer timer {statistics::render};
+
+      for (std::size_t i = 0; i < formats.size (); ++i)
+        {
+          if (i != 0 && !(cfg.formats & (1u << i)))
+            continue;
+
+          std::ostringstream out;
+          formats[i].write (env, out);
+
+          std::string file {mach_type ? variant_file (formats[i].file,
+                                                      *mach_type)
+                                      : formats[i].file};
+
+          files.push_back ({cfg.folder + '/' + file, out.str (), 0644});
+        }
+    };
+
+    {
+      const resolved_environment env {cfg.resolve ()};
+      render (env, nullptr);
+
+      if (cfg.compiler_launchers)
+        add_compiler_launchers (cfg, env, files);
+    }
+
+    // The variants share the expansions that do not use mach_type
+    if (!cfg.mach_types.empty ())
+      {
+        config variant {cfg};
+
+        for (const auto &mach_type : cfg.mach_types)
+          {
+            variant.variables["mach_type"] = mach_type;
+            variant.templates.refresh ("mach_type", variant.variables);
+
+            if (cfg.compiler_launchers)
+              {
+                variant.variant = mach_type;
+
+                // Before resolving, for PATH to have the bin directory
+                for (const char *name : {"", "bin"})
+                  {
+                    const std::string dir {variant.launcher_path (name)};
+
+                    if (mkdir (dir.c_str (), 0755) && errno != EEXIST)
+                      throw system_failure ("Creating the directory", dir,
+                                            errno);
+                  }
+              }
+
+            resolved_environment env {variant.resolve ()};
+            env.folder.append (":").append (mach_type);
+            render (env, &mach_type);
+
+            if (cfg.compiler_launchers)
+              add_compiler_launchers (variant, env, files);
+          }
+      }
+
+    // The manifest too, so that settings which do not show in the
+    // outputs are still saved
+    {
+      phase_timer timer {statistics::render};
+      files.push_back ({manifest_path (cfg.folder), encode_manifest (cfg),
+                        0644});
+    }
+
+    // The file names go in too, so that -f changes the hash
+    std::uint64_t hash = hash_bytes (nullptr, 0);
+
+    for (const auto &file : files)
+      {
+        hash = hash_bytes (file.path.c_str (), file.path.size () + 1, hash);
+        hash = hash_bytes (file.contents.data (), file.contents.size (),
+                           hash);
+      }
+
+    char hash_text[17];
+    std::snprintf (hash_text, sizeof (hash_text), "%016llx",
+                   (unsigned long long) hash);
+
+    // Whoever holds the lock may be writing the same files, wait for
+    // them and see whether that left anything to do
+    environment_lock lock {cfg.folder};
+    phase_timer timer {statistics::write};
+
+    const std::string hash_file {hash_path (cfg.folder)};
+    std::string old_hash;
+    bool missing = false;
+    struct stat st;
+
+    for (const auto &file : files)
+      missing = missing || stat (file.path.c_str (), &st);
+
+    if (!missing && read_file (hash_file, old_hash)
+        && old_hash == std::string {hash_text} + '\n')
+      return false;
+
+    // Leave the files that did not change alone as well
+    std::string old;
+
+    for (const auto &file : files)
+      if (!read_file (file.path, old) || old != file.contents)
+        replace_file (file.path, file.contents, file.mode);
+
+    // Last, so that a failure above writes everything again next time
+    replace_file (hash_file, std::string {hash_text} + '\n');
+    return true;
+  }
+
+  // Gives this process the variables the activate script would set and
+  // runs the command in place of it.  Only returns by throwing;
+  // exec_exception means the environment was set up but the command
+  // could not be run.
+  inline void
+  exec_environment (const config &cfg,
+                    char *const *argv)
+  {
+    std::string value;
+
+    for (const auto &var : cfg.resolve ().variables)
+      {
+        switch (var.type)
+          {
+          case resolved_variable::kind::prompt:
+            // Nothing to prompt for
+            continue;
+
+          case resolved_variable::kind::search:
+            value = var.joined ();
+
+            if (const char *old = getenv (var.name.c_str ()))
+              value.append (":").append (old);
+            break;
+
+          case resolved_variable::kind::literal:
+            value = var.value;
+            break;
+          }
+
+        if (setenv (var.name.c_str (), value.c_str (), 1))
+          throw system_failure ("Setting", var.name, errno);
+      }
+
+    execvp (argv[0], argv);
+
+    int errnum = errno;
+    throw exec_exception {system_failure ("Executing", argv[0], errnum)
+                          .what (), errnum};
+  }
+
+  inline bool
+  is_shared_library (const char *name)
+    noexcept
+  {
+    std::size_t len = std::strlen (name);
+
+    if (len > 6 && !std::strcmp (name + len - 6, ".dylib"))
+      return true;
+
+    const char *so = std::strstr (name, ".so");
+    return so && so != name && (so[3] == '\0' || so[3] == '.');
+  }
+
+  // The names in a directory, without . and ..
+  inline std::vector<std::string>
+  directory_entries (const std::string &path)
+  {
+    DIR *dir = opendir (path.c_str ());
+
+    if (!dir)
+      throw system_failure ("Opening the directory", path, errno);
+
+    std::vector<std::string> names;
+
+    while (const struct dirent *entry = readdir (dir))
+      if (std::strcmp (entry->d_name, ".")
+          && std::strcmp (entry->d_name, ".."))
+        names.push_back (entry->d_name);
+
+    closedir (dir);
+    return names;
+  }
+
+  // Removes a file or a whole directory tree, without following links
+  inline void
+  remove_tree (const std::string &path)
+  {
+    struct stat st;
+
+    if (lstat (path.c_str (), &st))
+      {
+        if (errno == ENOENT)
+          return;
+
+        throw system_failure ("Removing", path, errno);
+      }
+
+    if (!S_ISDIR (st.st_mode))
+      {
+        if (unlink (path.c_str ()))
+          throw system_failure ("Removing", path, errno);
+
+        return;
+      }
+
+    for (const auto &name : directory_entries (path))
+      remove_tree (path + '/' + name);
+
+    if (rmdir (path.c_str ()))
+      throw system_failure ("Removing the directory", path, errno);
+  }
+
+  // What the symlink at path points to, or an empty string when it is
+  // not one
+  inline std::string
+  link_target (const std::string &path)
+  {
+    std::string target (256, '\0');
+    ssize_t len;
+
+    while ((len = readlink (path.c_str (), &target[0], target.size ()))
+           == (ssize_t) target.size ())
+      target.resize (target.size () * 2);
+
+    target.resize (len > 0 ? len : 0);
+    return target;
+  }
+
+  // An index in .cenv is a symlink to a directory of its own, so that a
+  // new one replaces the old with a single rename and a reader always
+  // finds one or the other whole.  This makes the directory for the next
+  // one, named after path, and removes those that builds which did not
+  // finish left behind.  Returns its path.
+  inline std::string
+  make_index_generation (const std::string &path)
+  {
+    const std::string dir {path.substr (0, path.find_last_of ('/'))};
+    const std::string name {path.substr (dir.size () + 1)};
+    const std::string prefix {name + ".index-"};
+
+    const std::string current {link_target (path)};
+
+    for (const auto &entry : directory_entries (dir))
+      if (!entry.compare (0, prefix.size (), prefix) && entry != current)
+        remove_tree (dir + '/' + entry);
+
+    std::string generation {dir + '/' + prefix + "XXXXXX"};
+
+    if (!mkdtemp (&generation[0]))
+      throw system_failure ("Creating the directory", generation, errno);
+
+    if (chmod (generation.c_str (), 0755))
+      throw system_failure ("Changing the mode of", generation, errno);
+
+    return generation;
+  }
+
+  // Points the symlink at path to target, relative to its directory,
+  // with one rename.  Whatever was there before goes, a directory only
+  // with a remove first, which indexes made before they were symlinks
+  // need once.  Returns what the old link pointed to, if anything.
+  inline std::string
+  replace_link (const std::string &path,
+                const std::string &target)
+  {
+    const std::string old {link_target (path)};
+    struct stat st;
+
+    if (old.empty () && !lstat (path.c_str (), &st) && S_ISDIR (st.st_mode))
+      remove_tree (path);
+
+    const std::string temp {path + ".new"};
+    remove_tree (temp);
+
+    if (symlink (target.c_str (), temp.c_str ()))
+      throw system_failure ("Linking", temp, errno);
+
+    if (rename (temp.c_str (), path.c_str ()))
+      {
+        int saved = errno;
+        unlink (temp.c_str ());
+        throw system_failure ("Replacing", path, saved);
+      }
+
+    return old;
+  }
+
+  // Puts the generation from make_index_generation in place of the index
+  // at path, then removes the one it replaces
+  inline void
+  install_index_generation (const std::string &path,
+                            const std::string &generation)
+  {
+    const std::string dir {path.substr (0, path.find_last_of ('/'))};
+    const std::string old
+      {replace_link (path, generation.substr (dir.size () + 1))};
+
+    if (!old.empty () && old.find ('/') == std::string::npos)
+      remove_tree (dir + '/' + old);
+  }
+
+  // Links every shared library in the library directories into one
+  // directory, keeping the first one of each name like the loader would.
+  // The loader then probes a single directory per needed library.
+  // Returns the number of libraries indexed.
+  inline std::size_t
+  build_library_index (const config &cfg)
+  {
+    environment_lock lock {cfg.folder};
+
+    const std::string index {cfg.index_path ("lib")};
+    const std::string staging {make_index_generation (index)};
+
+    std::unordered_set<std::string> seen;
+    std::string target;
+    std::string link_path;
+
+    for (const auto &path : cfg.search_directories (cfg.library_suffixes))
+      {
+        DIR *dir = opendir (path.c_str ());
+
+        // Missing directories are simply not searched
+        if (!dir)
+          continue;
+
+        while (const struct dirent *entry = readdir (dir))
+          {
+            if (!is_shared_library (entry->d_name)
+                || !seen.insert (entry->d_name).second)
+              continue;
+
+            target.assign (path).append ("/").append (entry->d_name);
+            link_path.assign (staging).append ("/").append (entry->d_name);
+
+            struct stat st;
+            if (stat (target.c_str (), &st) || S_ISDIR (st.st_mode))
+              {
+                seen.erase (entry->d_name);
+                continue;
+              }
+
+            if (symlink (target.c_str (), link_path.c_str ()))
+              {
+                int errno_save = errno;
+                closedir (dir);
+                throw system_failure ("Linking", link_path, errno_save);
+              }
+          }
+
+        closedir (dir);
+      }
+
+    install_index_generation (index, staging);
+    return seen.size ();
+  }
+
+  // Merges the include directories in sources into dest, writing the
+  // matching clang VFS overlay entries as well.  A name that only one
+  // directory provides is linked as a whole; dest is empty below such a
+  // link, where only the overlay entries are needed.
+  inline std::size_t
+  merge_header_directories (const std::vector<std::string> &sources,
+                            const std::string &dest,
+                            std::ostream &overlay,
+                            unsigned level)
+  {
+    struct merged_entry
+    {
+      std::string file;
+      std::vector<std::string> dirs;
+    };
+
+    if (level > 64)
+      throw environment_exception {"Include directories nested too deeply "
+                                   "in " + sources.front ()};
+
+    // Sorted, so the overlay comes out the same every time
+    std::map<std::string, merged_entry> entries;
+    std::string path;
+
+    for (const auto &source : sources)
+      {
+        DIR *dir = opendir (source.c_str ());
+
+        if (!dir)
+          continue;
+
+        while (const struct dirent *entry = readdir (dir))
+          {
+            if (!std::strcmp (entry->d_name, ".")
+                || !std::strcmp (entry->d_name, ".."))
+              continue;
+
+            path.assign (source).append ("/").append (entry->d_name);
+
+            struct stat st;
+            if (stat (path.c_str (), &st))
+              continue;
+
+            merged_entry &merged = entries[entry->d_name];
+
+            // Taken by a file already, like the compiler would find it
+            if (!merged.file.empty ())
+              continue;
+
+            if (S_ISDIR (st.st_mode))
+              merged.dirs.push_back (path);
+            else if (merged.dirs.empty ())
+              merged.file = path;
+          }
+
+        closedir (dir);
+      }
+
+    std::size_t count = 0;
+    bool first = true;
+    std::string dest_path;
+
+    for (const auto &e : entries)
+      {
+        if (!first)
+          overlay << ",\n";
+        first = false;
+
+        if (!dest.empty ())
+          dest_path.assign (dest).append ("/").append (e.first);
+
+        overlay << std::string (2 * level + 8, ' ') << "{\"name\": ";
+        write_json_string (overlay, e.first);
+
+        if (!e.second.file.empty ())
+          {
+            if (!dest.empty ()
+                && symlink (e.second.file.c_str (), dest_path.c_str ()))
+              throw system_failure ("Linking", dest_path, errno);
+
+            overlay << ", \"type\": \"file\", \"external-contents\": ";
+            write_json_string (overlay, e.second.file);
+            overlay << '}';
+            ++count;
+            continue;
+          }
+
+        std::string below;
+
+        if (!dest.empty ())
+          {
+            if (e.second.dirs.size () == 1)
+              {
+                if (symlink (e.second.dirs.front ().c_str (),
+                             dest_path.c_str ()))
+                  throw system_failure ("Linking", dest_path, errno);
+              }
+            else
+              {
+                if (mkdir (dest_path.c_str (), 0755))
+                  throw system_failure ("Creating the directory", dest_path,
+                                        errno);
+                below = dest_path;
+              }
+          }
+
+        overlay << ", \"type\": \"directory\", \"contents\": [\n";
+        count += merge_header_directories (e.second.dirs, below, overlay,
+                                           level + 1);
+        overlay << '\n' << std::string (2 * level + 8, ' ') << "]}";
+      }
+
+    return count;
+  }
+
+  // Merges the include directories into one tree of links, so that the
+  // compiler looks a header up in a single directory, and writes a
+  // clang VFS overlay of the same tree.  Both live in one generation
+  // behind .cenv/headers, which .cenv/include and .cenv/include.yaml
+  // point into, so that the tree and the overlay change together.
+  // Returns the number of headers indexed.
+  inline std::size_t
+  build_header_index (const config &cfg)
+  {
+    environment_lock lock {cfg.folder};
+
+    const std::string index {cfg.index_path ("include")};
+    const std::string headers {cfg.index_path ("headers")};
+    const std::string generation {make_index_generation (headers)};
+    const std::string staging {generation + "/include"};
+    const std::string overlay_staging {generation + "/include.yaml"};
+
+    if (mkdir (staging.c_str (), 0755))
+      throw system_failure ("Creating the directory", staging, errno);
+
+    std::ofstream overlay;
+    overlay.exceptions (std::ios::badbit);
+    overlay.open (overlay_staging);
+
+    if (!overlay.is_open ())
+      throw system_failure ("Writing", overlay_staging, errno);
+
+    overlay << "{\n"
+               "  \"version\": 0,\n"
+               "  \"case-sensitive\": \"true\",\n"
+               "  \"roots\": [\n"
+               "    {\n"
+               "      \"name\": ";
+    write_json_string (overlay, index);
+    overlay << ",\n"
+               "      \"type\": \"directory\",\n"
+               "      \"contents\": [\n";
+
+    std::size_t count = merge_header_directories
+      (cfg.search_directories (cfg.include_suffixes), staging, overlay, 0);
+
+    overlay << "\n"
+               "      ]\n"
+               "    }\n"
+               "  ]\n"
+               "}\n";
+    overlay.close ();
+
+    install_index_generation (headers, generation);
+
+    // Made once, they lead to whichever generation is in place
+    for (const char *name : {"include", "include.yaml"})
+      {
+        const std::string path {cfg.index_path (name)};
+        const std::string target {std::string {"headers/"} + name};
+
+        if (link_target (path) != target)
+          replace_link (path, target);
+      }
+
+    return count;
+  }
+
+  // A module from a .pc file, with its variables expanded
+  struct pkgconfig_module
+  {
+    std::string version;
+    std::string cflags;
+    std::string libs;
+    std::string requires;
+    std::string requires_private;
+  };
+
+  // Reads a .pc file.  Returns false if it is missing, lacks a Name,
+  // Description or Version, or uses syntax the substitution engine does
+  // not take, like a $ before a plain word.
+  inline bool
+  read_pkgconfig_file (const std::string &path,
+                       pkgconfig_module &module)
+  {
+    std::string contents;
+
+    if (!read_file (path, contents))
+      return false;
+
+    static const char blanks[] {" \t\r"};
+    variable_map variables;
+    variables["pcfiledir"] = path.substr (0, path.find_last_of ('/'));
+    std::string line;
+    std::string value;
+    unsigned fields = 0;
+
+    for (std::size_t pos = 0; pos < contents.size ();)
+      {
+        line.clear ();
+
+        // A backslash at the end of a line continues it
+        do
+          {
+            std::size_t end = contents.find ('\n', pos);
+            if (end == std::string::npos)
+              end = contents.size ();
+
+            line.append (contents, pos, end - pos);
+            pos = end + 1;
+
+            if (!line.empty () && line.back () == '\\')
+              line.pop_back ();
+            else
+              break;
+          }
+        while (pos < contents.size ());
+
+        line.erase (std::min (line.find ('#'), line.size ()));
+
+        const std::size_t sep = line.find_first_of (":=");
+        if (sep == std::string::npos)
+          continue;
+
+        const std::size_t key_begin = line.find_first_not_of (blanks);
+        const std::size_t key_end = line.find_last_not_of (blanks, sep - 1);
+        if (key_begin >= sep || key_end == std::string::npos)
+          continue;
+
+        const std::string key {line, key_begin, key_end + 1 - key_begin};
+        std::size_t value_begin = line.find_first_not_of (blanks, sep + 1);
+        std::size_t value_end = line.find_last_not_of (blanks);
+        if (value_begin == std::string::npos)
+          value_begin = value_end = sep;
+
+        value.clear ();
+
+        try
+          {
+            substitute_vars (line.data () + value_begin,
+                             line.data () + value_end + 1, value, variables);
+          }
+        catch (const syntax_exception &)
+          {
+            return false;
+          }
+
+        if (line[sep] == '=')
+          variables[key] = value;
+        else if (key == "Name")
+          fields |= 1;
+        else if (key == "Description")
+          fields |= 2;
+        else if (key == "Version")
+          {
+            module.version = value;
+            fields |= 4;
+          }
+        else if (key == "Cflags" || key == "CFlags")
+          module.cflags = value;
+        else if (key == "Libs")
+          module.libs = value;
+        else if (key == "Requires")
+          module.requires = value;
+        else if (key == "Requires.private")
+          module.requires_private = value;
+      }
+
+    // pkg-config rejects modules without these
+    return fields == 7;
+  }
+
+  // Splits str at blanks and at any of the extra separators
+  inline std::vector<std::string>
+  split_words (const std::string &str,
+               const char *separators = " \t\r\n")
+  {
+    std::vector<std::string> words;
+    std::size_t pos = 0;
+
+    while ((pos = str.find_first_not_of (separators, pos))
+           != std::string::npos)
+      {
+        std::size_t end = std::min (str.find_first_of (separators, pos),
+                                    str.size ());
+        words.emplace_back (str, pos, end - pos);
+        pos = end;
+      }
+
+    return words;
+  }
+
+  // Resolves the modules of the pkg-config directories of an
+  // environment with their requirements, as pkg-config would answer
+  // --modversion, --cflags and --libs for them.
+  class pkgconfig_resolver final
+  {
+  public:
+    struct answer
+    {
+      std::string version;
+      std::vector<std::string> cflags;
+      std::vector<std::string> libs;
+    };
+
+    explicit pkgconfig_resolver (std::vector<std::string> dirs)
+      : dirs {std::move (dirs)}
+    {
+    }
+
+    // Every module name in the directories, each once
+    std::vector<std::string>
+    module_names ()
+      const
+    {
+      std::vector<std::string> names;
+      std::unordered_set<std::string> seen;
+
+      for (const auto &path : dirs)
+        {
+          DIR *dir = opendir (path.c_str ());
+
+          if (!dir)
+            continue;
+
+          while (const struct dirent *entry = readdir (dir))
+            {
+              std::size_t len = std::strlen (entry->d_name);
+
+              if (len > 3 && !std::strcmp (entry->d_name + len - 3, ".pc")
+                  && seen.emplace (entry->d_name, len - 3).second)
+                names.emplace_back (entry->d_name, len - 3);
+            }
+
+          closedir (dir);
+        }
+
+      std::sort (names.begin (), names.end ());
+      return names;
+    }
+
+    // Returns nullptr if the module or one of its requirements cannot
+    // be found or read, or if they require each other
+    const answer *
+    resolve (const std::string &name)
+    {
+      auto itr = entries.find (name);
+
+      if (itr != entries.end ())
+        return itr->second.state == progress::done ? &itr->second.result
+                                                : nullptr;
+
+      entry &e = entries[name];
+      e.state = progress::failed;
+
+      pkgconfig_module module;
+      if (!find (name, module))
+        return nullptr;
+
+      e.state = progress::visiting;
+      e.result.version = module.version;
+      e.result.cflags = split_words (module.cflags);
+      e.result.libs = split_words (module.libs);
+
+      for (const auto &req : requirements (module.requires))
+        {
+          const answer *dep = resolve (req);
+          if (!dep)
+            return fail (e);
+
+          append (e.result.cflags, dep->cflags);
+          append (e.result.libs, dep->libs);
+        }
+
+      // Private requirements only add to the compiler flags
+      for (const auto &req : requirements (module.requires_private))
+        {
+          const answer *dep = resolve (req);
+          if (!dep)
+            return fail (e);
+
+          append (e.result.cflags, dep->cflags);
+        }
+
+      clean (e.result.cflags);
+      clean (e.result.libs);
+      e.state = progress::done;
+      return &e.result;
+    }
+
+  private:
+    enum class progress
+    {
+      visiting,
+      done,
+      failed
+    };
+
+    struct entry
+    {
+      progress state;
+      answer result;
+    };
+
+    // The first directory with the module wins, like in PKG_CONFIG_PATH
+    bool
+    find (const std::string &name,
+          pkgconfig_module &module)
+      const
+    {
+      for (const auto &dir : dirs)
+        if (read_pkgconfig_file (dir + '/' + name + ".pc", module))
+          return true;
+
+      return false;
+    }
+
+    const answer *
+    fail (entry &e)
+      noexcept
+    {
+      e.state = progress::failed;
+      return nullptr;
+    }
+
+    // The module names of a Requires field, without the version checks
+    static std::vector<std::string>
+    requirements (const std::string &field)
+    {
+      std::vector<std::string> names;
+      bool version_next = false;
+
+      for (auto &word : split_words (field, " \t\r\n,"))
+        if (version_next)
+          version_next = false;
+        else if (std::strchr ("<>=!", word[0]))
+          version_next = true;
+        else
+          names.push_back (std::move (word));
+
+      return names;
+    }
+
+    static void
+    append (std::vector<std::string> &flags,
+            const std::vector<std::string> &more)
+    {
+      flags.insert (flags.end (), more.begin (), more.end ());
+    }
+
+    // Drops the default system directories, which pkg-config leaves out
+    // as well, and repeated flags.  Search directories keep their first
+    // place, so that they are searched in the same order; anything else,
+    // libraries in particular, keeps its last, to come after whatever
+    // uses it.
+    static void
+    clean (std::vector<std::string> &flags)
+    {
+      static const char *const system_dirs[] {
+        "-I/usr/include", "-L/usr/lib", "-L/usr/lib64", "-L/lib", "-L/lib64"
+      };
+
+      std::unordered_map<std::string, std::size_t> last;
+      for (std::size_t i = 0; i < flags.size (); ++i)
+        last[flags[i]] = i;
+
+      std::unordered_set<std::string> seen;
+      std::vector<std::string> kept;
+
+      for (std::size_t i = 0; i < flags.size (); ++i)
+        {
+          const std::string &flag = flags[i];
+
+          if (std::find (std::begin (system_dirs), std::end (system_dirs),
+                         flag) != std::end (system_dirs))
+            continue;
+
+          if (!flag.compare (0, 2, "-I") || !flag.compare (0, 2, "-L"))
+            {
+              if (seen.insert (flag).second)
+                kept.push_back (flag);
+            }
+          else if (last[flag] == i)
+            kept.push_back (flag);
+        }
+
+      flags.swap (kept);
+    }
+
+    std::vector<std::string> dirs;
+    std::map<std::string, entry> entries {};
+  };
+
+  // Writes .cenv/bin/pkg-config, a shell script with the answers of
+  // every module built in.  Queries it cannot answer, and any other
+  // options, go to the next pkg-config in PATH.  Returns the number of
+  // modules in it.
+  inline std::size_t
+  build_pkgconfig_cache (const config &cfg)
+  {
+    environment_lock lock {cfg.folder};
+
+    const std::string bin {cfg.index_path ("bin")};
+
+    if (mkdir (bin.c_str (), 0755) && errno != EEXIST)
+      throw system_failure ("Creating the directory", bin, errno);
+
+    pkgconfig_resolver resolver
+      {cfg.search_directories (cfg.pkg_config_suffixes)};
+
+    const auto join = [] (const std::vector<std::string> &flags)
+      -> std::string {
+      std::string result;
+
+      for (const auto &flag : flags)
+        {
+          if (!result.empty ())
+            result.push_back (' ');
+
+          result.append (flag);
+        }
+
+      return result;
+    };
+
+    std::ostringstream script;
+    std::size_t count = 0;
+
+    script << "#!/bin/sh\n"
+              "# pkg-config answers cached by cenv pkgconfig-cache\n"
+              "\n"
+              "self=";
+    write_sh_single_quoted (script, bin);
+    script << "\n"
+              "\n";
+    write_sh_fallback (script, "pkg-config");
+    script << "\n"
+              "lookup () {\n"
+              "  case $1 in\n";
+
+    for (const auto &name : resolver.module_names ())
+      if (const auto *answer = resolver.resolve (name))
+        {
+          script << "    ";
+          write_sh_single_quoted (script, name);
+          script << ") version=";
+          write_sh_single_quoted (script, answer->version);
+          script << " cflags=";
+          write_sh_single_quoted (script, join (answer->cflags));
+          script << " libs=";
+          write_sh_single_quoted (script, join (answer->libs));
+          script << " ;;\n";
+          ++count;
+        }
+
+    script << "    *) return 1 ;;\n"
+              "  esac\n"
+              "}\n"
+              "\n"
+              "if [ -n \"${PKG_CONFIG_SYSROOT_DIR-}${PKG_CONFIG_LIBDIR-}\" ]; "
+              "then\n"
+              "  fallback \"$@\"\n"
+              "fi\n"
+              "\n"
+              "want_version= want_cflags= want_libs= found=\n"
+              "for arg do\n"
+              "  case $arg in\n"
+              "    --modversion) want_version=1 ;;\n"
+              "    --cflags) want_cflags=1 ;;\n"
+              "    --libs) want_libs=1 ;;\n"
+              "    --exists|--print-errors|--short-errors|--silence-errors) "
+              ";;\n"
+              "    -*|''|*[!A-Za-z0-9_.+-]*) fallback \"$@\" ;;\n"
+              "    *) found=$found. ;;\n"
+              "  esac\n"
+              "done\n"
+              "\n"
+              "# Flags of several modules need merging, leave that to\n"
+              "# pkg-config\n"
+              "case $found,$want_version,$want_cflags$want_libs in\n"
+              "  ,*|*,1,?*|..*,,?*) fallback \"$@\" ;;\n"
+              "esac\n"
+              "\n"
+              "versions=\n"
+              "nl='\n"
+              "'\n"
+              "for arg do\n"
+              "  case $arg in\n"
+              "    -*) continue ;;\n"
+              "  esac\n"
+              "  lookup \"$arg\" || fallback \"$@\"\n"
+              "  versions=$versions$version$nl\n"
+              "done\n"
+              "\n"
+              "[ -n \"$want_cflags\" ] || cflags=\n"
+              "[ -n \"$want_libs\" ] || libs=\n"
+              "flags=$cflags${cflags:+${libs:+ }}$libs\n"
+              "\n"
+              "if [ -n \"$want_version\" ]; then\n"
+              "  printf '%s' \"$versions\"\n"
+              "elif [ -n \"$want_cflags$want_libs\" ]; then\n"
+              "  printf '%s\\n' \"${flags:+$flags }\"\n"
+              "fi\n";
+
+    replace_file (bin + "/pkg-config", script.str (), 0755);
+    return count;
+  }
+
+  // Copies a regular file.  Where the file system can, the copy shares
+  // its blocks with the original: a reflink first, then
+  // copy_file_range, which may do the same in the kernel, and only then
+  // plain reads and writes.
+  inline void
+  copy_file (const std::string &from,
+             const std::string &to,
+             mode_t mode)
+  {
+    int in = open (from.c_str (), O_RDONLY | O_CLOEXEC);
+
+    if (in < 0)
+      throw system_failure ("Opening", from, errno);
+
+    int out = open (to.c_str (), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                    0600);
+
+    if (out < 0)
+      {
+        int errno_save = errno;
+        close (in);
+        throw system_failure ("Creating", to, errno_save);
+      }
+
+    int error = fchmod (out, mode & 07777) ? errno : 0;
+    bool done = false;
+
+#ifdef HAVE_FICLONE
+    done = !error && !ioctl (out, FICLONE, in);
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while (!done && !error)
+      {
+        ssize_t copied = copy_file_range (in, nullptr, out, nullptr,
+                                          1 << 30, 0);
+
+        if (copied == 0)
+          done = true;
+        else if (copied < 0)
+          {
+            // Both offsets moved along, so the loop below carries on
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+                || errno == EOPNOTSUPP)
+              break;
+
+            if (errno != EINTR)
+              error = errno;
+          }
+      }
+#endif
+
+    char block[65536];
+
+    while (!done && !error)
+      {
+        ssize_t got = read (in, block, sizeof (block));
+
+        if (got == 0)
+          done = true;
+        else if (got < 0)
+          {
+            if (errno != EINTR)
+              error = errno;
+          }
+        else
+          for (ssize_t put = 0; put < got && !error;)
+            {
+              ssize_t written = write (out, block + put, got - put);
+
+              if (written >= 0)
+                put += written;
+              else if (errno != EINTR)
+                error = errno;
+            }
+      }
+
+    close (in);
+
+    if (close (out) && !error)
+      error = errno;
+
+    if (error)
+      {
+        unlink (to.c_str ());
+        throw system_failure ("Copying", from, error);
+      }
+  }
+
+  // Whether cenv wrote the file in .cenv with that relative name, which
+  // may then name the folder: the manifest, the hash, the header overlay,
+  // the pkg-config shim and the compiler launchers with their response
+  // files, those of -T variants one directory down included.  Anything
+  // else there, like the objects of a compiler cache, is not.
+  inline bool
+  is_generated_state (const std::string &name)
+  {
+    if (name == "manifest" || name == "hash" || name == "bin/pkg-config")
+      return true;
+
+    // The header overlay is in the generation behind .cenv/headers
+    static const std::string overlay {"/include.yaml"};
+
+    if (!name.compare (0, 14, "headers.index-")
+        && name.size () > overlay.size ()
+        && !name.compare (name.size () - overlay.size (), overlay.size (),
+                          overlay))
+      return true;
+
+    std::size_t slash = name.find ('/');
+    const std::string launcher {slash == std::string::npos
+                                || !name.compare (0, slash, "bin")
+                                ? name : name.substr (slash + 1)};
+
+    return launcher == "bin/cc" || launcher == "bin/c++"
+      || (launcher.find ('/') == std::string::npos
+          && launcher.size () > 4
+          && !launcher.compare (launcher.size () - 4, 4, ".rsp"));
+  }
+
+  // Copies the contents of the directory from into the existing
+  // directory to.  Links into src are moved into dst, and so are paths
+  // in the files cenv writes to .cenv, see is_generated_state.  With
+  // link_files, regular files outside .cenv are hard links to the
+  // originals.  Sockets, pipes and devices are left out.  Returns the
+  // number of files copied.
+  inline std::size_t
+  clone_directory (const std::string &from,
+                   const std::string &to,
+                   const std::string &src,
+                   const std::string &dst,
+                   bool link_files)
+  {
+    const std::string state {src + "/.cenv/"};
+    std::size_t count = 0;
+    std::string contents;
+
+    for (const auto &name : directory_entries (from))
+      {
+        const std::string source {from + '/' + name};
+        const std::string target {to + '/' + name};
+        struct stat st;
+
+        if (lstat (source.c_str (), &st))
+          throw system_failure ("Reading", source, errno);
+
+        if (S_ISDIR (st.st_mode))
+          {
+            if (mkdir (target.c_str (), st.st_mode & 07777))
+              throw system_failure ("Creating the directory", target, errno);
+
+            count += clone_directory (source, target, src, dst, link_files);
+          }
+        else if (S_ISLNK (st.st_mode))
+          {
+            std::string link (st.st_size + 1, '\0');
+            ssize_t len = readlink (source.c_str (), &link[0], link.size ());
+
+            if (len < 0 || (std::size_t) len >= link.size ())
+              throw system_failure ("Reading the link", source,
+                                    len < 0 ? errno : ENAMETOOLONG);
+
+            link.resize (len);
+
+            if (match_path (link, 0, src))
+              link = rewrite_paths (link, src, dst);
+
+            if (symlink (link.c_str (), target.c_str ()))
+              throw system_failure ("Linking", target, errno);
+
+            ++count;
+          }
+        else if (S_ISREG (st.st_mode))
+          {
+            const bool in_state = !source.compare (0, state.size (), state);
+
+            if (in_state && is_generated_state (source.substr (state.size ())))
+              {
+                // Small files cenv made, which may name the folder
+                if (!read_file (source, contents))
+                  throw system_failure ("Reading", source, ENOENT);
+
+                replace_file (target, rewrite_paths (contents, src, dst),
+                              st.st_mode & 07777);
+              }
+            else if (in_state || !link_files
+                     || link (source.c_str (), target.c_str ()))
+              copy_file (source, target, st.st_mode);
+
+            ++count;
+          }
+      }
+
+    return count;
+  }
+
+  // Copies the environment in src to the new folder dst and writes its
+  // files again, with every setting naming src moved to dst.  As long as
+  // the file system shares blocks between copies, that is quick whatever
+  // the size of the tree.  Returns the number of files copied.
+  inline std::size_t
+  clone_environment (const std::string &src,
+                     const std::string &dst,
+                     bool link_files)
+  {
+    char *src_res = realpath (src.c_str (), nullptr);
+
+    if (!src_res)
+      throw system_failure ("Resolving the directory", src, errno);
+
+    const std::string from {src_res};
+    free (src_res);
+
+    // Keep writers of the source out while copying it
+    environment_lock lock {from};
+
+    config cfg;
+    load_manifest (from, cfg);
+
+    if (mkdir (dst.c_str (), 0755))
+      throw system_failure ("Creating the directory", dst, errno);
+
+    std::size_t count;
+
+    try
+      {
+        cfg.folder = dst;
+        open_environment (cfg, false);
+        const std::string &to = cfg.folder;
+
+        count = clone_directory (from, to, from, to, link_files);
+
+        const auto rewrite = [&] (std::string &str) -> void {
+          str = rewrite_paths (str, from, to);
+        };
+
+        const auto base_name = [] (const std::string &path) -> std::string {
+          return path.substr (path.find_last_of ('/') + 1);
+        };
+
+        // The default prompt names the folder
+        if (cfg.prompt == '(' + base_name (from) + ") ")
+          cfg.prompt = '(' + base_name (to) + ") ";
+
+        rewrite (cfg.root);
+
+        for (auto &base : cfg.bases)
+          rewrite (base);
+
+        for (auto *map : {&cfg.variables, &cfg.environment_variables})
+          {
+            variable_map moved;
+
+            for (const auto &var : *map)
+              moved[var.first] = rewrite_paths (var.second, from, to);
+
+            *map = std::move (moved);
+          }
+
+        for (auto *list : {&cfg.executable_suffixes, &cfg.include_suffixes,
+                           &cfg.info_suffixes, &cfg.library_suffixes,
+                           &cfg.manpage_suffixes, &cfg.pkg_config_suffixes})
+          for (auto &suffix : *list)
+            rewrite (suffix);
+
+        create_environment (cfg, false);
+      }
+    catch (...)
+      {
+        remove_tree (dst);
+        throw;
+      }
+
+    return count;
+  }
+
+  // A whole file, mapped for reading
+  class mapped_file final
+  {
+  public:
+    explicit mapped_file (const std::string &path)
+    {
+      int fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+
+      if (fd < 0)
+        throw system_failure ("Opening", path, errno);
+
+      if (fstat (fd, &st))
+        {
+          int saved = errno;
+          close (fd);
+          throw system_failure ("Reading", path, saved);
+        }
+
+      if (st.st_size > 0)
+        {
+          void *data = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                             0);
+
+          if (data == MAP_FAILED)
+            {
+              int saved = errno;
+              close (fd);
+              throw system_failure ("Mapping", path, saved);
+            }
+
+          begin = static_cast<const char *> (data);
+        }
+
+      close (fd);
+    }
+
+    mapped_file (const mapped_file &) = delete;
+
+    mapped_file &
+    operator= (const mapped_file &) = delete;
+
+    ~mapped_file ()
+    {
+      if (begin)
+        munmap (const_cast<char *> (begin), st.st_size);
+    }
+
+    const char *
+    data ()
+      const
+      noexcept
+    {
+      return begin;
+    }
+
+    std::size_t
+    size ()
+      const
+      noexcept
+    {
+      return st.st_size;
+    }
+
+    const struct stat &
+    status ()
+      const
+      noexcept
+    {
+      return st;
+    }
+
+  private:
+    struct stat st;
+    const char *begin {nullptr};
+  };
+
+  struct store_counts
+  {
+    // Files that are now links to the store
+    std::size_t files {0};
+    // What they no longer take up on their own
+    unsigned long long bytes {0};
+  };
+
+  // Puts the file at path into the store, or replaces it with a link to
+  // the same contents there.  An object is named after the hash of the
+  // contents, their size and the mode without the write bits, and the
+  // contents are compared before linking, so a collision of the hash
+  // only costs another name.  Objects are read-only, since writing to
+  // one would change every file linked to it.
+  inline void
+  store_file (const std::string &store,
+              const std::string &path,
+              store_counts &counts)
+  {
+    const mapped_file file {path};
+    const mode_t mode = file.status ().st_mode & 07555;
+    char key[64];
+
+    std::snprintf (key, sizeof (key), "%016llx-%llu-%o",
+                   (unsigned long long) hash_bytes (file.data (),
+                                                    file.size ()),
+                   (unsigned long long) file.size (), (unsigned) mode);
+
+    const std::string dir {store + "/objects/" + std::string {key, 2}};
+
+    if (mkdir (dir.c_str (), 0755) && errno != EEXIST)
+      throw system_failure ("Creating the directory", dir, errno);
+
+    for (unsigned n = 0;; ++n)
+      {
+        std::string object {dir + '/' + (key + 2)};
+
+        if (n)
+          object.append (".").append (std::to_string (n));
+
+        if (!link (path.c_str (), object.c_str ()))
+          {
+            if (chmod (object.c_str (), mode))
+              throw system_failure ("Changing the mode of", object, errno);
+
+            ++counts.files;
+            return;
+          }
+
+        if (errno == EXDEV)
+          throw environment_exception {store + " is not on the file system "
+                                       "of " + path};
+
+        if (errno != EEXIST)
+          throw system_failure ("Linking into the store", path, errno);
+
+        const mapped_file other {object};
+
+        if (other.status ().st_dev == file.status ().st_dev
+            && other.status ().st_ino == file.status ().st_ino)
+          return;
+
+        if (other.size () != file.size ()
+            || (file.size ()
+                && std::memcmp (other.data (), file.data (), file.size ())))
+          continue;
+
+        const std::string temp {path + ".cenv-store"};
+
+        if (link (object.c_str (), temp.c_str ()))
+          throw system_failure ("Linking", temp, errno);
+
+        if (rename (temp.c_str (), path.c_str ()))
+          {
+            int saved = errno;
+            unlink (temp.c_str ());
+            throw system_failure ("Replacing", path, saved);
+          }
+
+        ++counts.files;
+        counts.bytes += file.size ();
+        return;
+      }
+  }
+
+  // Stores the regular files below path, without following links.  seen
+  // holds the files met already, by device and inode, for directories
+  // that more than one suffix names.
+  inline void
+  store_directory (const std::string &store,
+                   const std::string &path,
+                   std::set<std::pair<dev_t, ino_t>> &seen,
+                   store_counts &counts)
+  {
+    for (const auto &name : directory_entries (path))
+      {
+        const std::string entry {path + '/' + name};
+        struct stat st;
+
+        if (lstat (entry.c_str (), &st))
+          throw system_failure ("Reading", entry, errno);
+
+        if (!seen.emplace (st.st_dev, st.st_ino).second)
+          continue;
+
+        if (S_ISDIR (st.st_mode))
+          store_directory (store, entry, seen, counts);
+        else if (S_ISREG (st.st_mode) && st.st_size > 0)
+          store_file (store, entry, counts);
+      }
+  }
+
+  // Moves the files in the directories the suffixes of the environment
+  // name into the content-addressed store, and links those of the same
+  // contents to a single copy there.  Every environment on the machine
+  // using the store then shares one inode, and one set of cached pages,
+  // for each of them.  The store has to be on the same file system.
+  inline store_counts
+  add_to_store (const config &cfg,
+                const std::string &store)
+  {
+    environment_lock lock {cfg.folder};
+
+    for (const std::string &dir : {store, store + "/objects"})
+      if (mkdir (dir.c_str (), 0755) && errno != EEXIST)
+        throw system_failure ("Creating the directory", dir, errno);
+
+    std::set<std::pair<dev_t, ino_t>> seen;
+    store_counts counts;
+    struct stat st;
+
+    // The state of cenv is not shared
+    if (!lstat ((cfg.folder + "/.cenv").c_str (), &st))
+      seen.emplace (st.st_dev, st.st_ino);
+
+    for (const auto *suffixes : {&cfg.executable_suffixes,
+                                 &cfg.include_suffixes, &cfg.info_suffixes,
+                                 &cfg.library_suffixes, &cfg.manpage_suffixes,
+                                 &cfg.pkg_config_suffixes})
+      for (const auto &dir : cfg.search_directories (*suffixes))
+        if (!lstat (dir.c_str (), &st) && S_ISDIR (st.st_mode)
+            && seen.emplace (st.st_dev, st.st_ino).second)
+          store_directory (store, dir, seen, counts);
+
+    return counts;
+  }
+
+  // Keeps the environments of the folders it is asked about resolved,
+  // and their outputs once rendered.  The .cenv directories of the
+  // folders and of their bases are watched with inotify, and an
+  // environment is forgotten when a manifest or a hash there changes.
+  // cenv writes the hash again whenever any of its outputs change, so
+  // the index-* modes and refreshes are seen as well.  Directories that
+  // come and go under -x are only seen once the folder is refreshed,
+  // like in its scripts.
+  class resolution_cache final
+  {
+  public:
+    resolution_cache ()
+      : fd {inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)}
+    {
+      if (fd < 0)
+        throw environment_exception {"Starting inotify failed: "
+                                     + errno_message (errno)};
+    }
+
+    resolution_cache (const resolution_cache &) = delete;
+
+    resolution_cache &
+    operator= (const resolution_cache &) = delete;
+
+    ~resolution_cache ()
+    {
+      close (fd);
+    }
+
+    // Readable when update () has something to do
+    int
+    descriptor ()
+      const
+      noexcept
+    {
+      return fd;
+    }
+
+    // The folder in the format with the index of output_formats ()
+    const std::string &
+    render (const std::string &folder,
+            std::size_t format)
+    {
+      auto found = entries.find (folder);
+
+      if (found == entries.end ())
+        found = entries.emplace (folder, load (folder)).first;
+
+      entry &e = found->second;
+
+      if (!e.rendered[format])
+        {
+          std::ostringstream out;
+          output_formats ()[format].write (e.env, out);
+          e.outputs[format] = out.str ();
+          e.rendered[format] = true;
+        }
+
+      return e.outputs[format];
+    }
+
+    // Forgets the environments the pending events touch
+    void
+    update ()
+    {
+      alignas (struct inotify_event) char buffer[4096];
+      ssize_t got;
+
+      while ((got = read (fd, buffer, sizeof (buffer))) != 0)
+        {
+          if (got < 0)
+            {
+              if (errno == EINTR)
+                continue;
+
+              if (errno == EAGAIN)
+                break;
+
+              throw environment_exception {"Reading inotify events "
+                                           "failed: "
+                                           + errno_message (errno)};
+            }
+
+          for (const char *p = buffer; p < buffer + got;)
+            {
+              const auto *event
+                = reinterpret_cast<const struct inotify_event *> (p);
+              p += sizeof (struct inotify_event) + event->len;
+
+              if (event->mask & IN_Q_OVERFLOW)
+                {
+                  entries.clear ();
+                  dependents.clear ();
+                  continue;
+                }
+
+              // Events of the directory itself have no name
+              if (event->len && std::strcmp (event->name, "manifest")
+                  && std::strcmp (event->name, "hash"))
+                continue;
+
+              auto found = dependents.find (event->wd);
+
+              if (found == dependents.end ())
+                continue;
+
+              for (const auto &folder : found->second)
+                entries.erase (folder);
+
+              dependents.erase (found);
+            }
+        }
+    }
+
+  private:
+    struct entry
+    {
+      resolved_environment env;
+      std::vector<std::string> outputs;
+      std::vector<bool> rendered;
+    };
+
+    // The manifests are watched before they are read, so that a change
+    // in between cannot go unnoticed
+    entry
+    load (const std::string &folder)
+    {
+      watch (folder, folder);
+
+      config cfg;
+      load_manifest (folder, cfg);
+      open_environment (cfg, false);
+
+      std::vector<std::string> pending {cfg.bases};
+      std::set<std::string> seen;
+
+      while (!pending.empty ())
+        {
+          const std::string base {std::move (pending.back ())};
+          pending.pop_back ();
+
+          if (!seen.insert (base).second)
+            continue;
+
+          watch (base, folder);
+
+          config base_cfg;
+          load_manifest (base, base_cfg);
+          pending.insert (pending.end (), base_cfg.bases.cbegin (),
+                          base_cfg.bases.cend ());
+        }
+
+      const std::size_t formats = output_formats ().size ();
+      return {cfg.resolve (), std::vector<std::string> (formats),
+              std::vector<bool> (formats)};
+    }
+
+    void
+    watch (const std::string &folder,
+           const std::string &dependent)
+    {
+      const std::string dir {folder + "/.cenv"};
+      int wd = inotify_add_watch (fd, dir.c_str (),
+                                  IN_CLOSE_WRITE | IN_MOVED_TO
+                                  | IN_MOVED_FROM | IN_DELETE
+                                  | IN_DELETE_SELF | IN_MOVE_SELF
+                                  | IN_ONLYDIR);
+
+      if (wd < 0)
+        throw system_failure ("Watching", dir, errno);
+
+      dependents[wd].insert (dependent);
+    }
+
+    int fd;
+    std::unordered_map<std::string, entry> entries;
+    // The folders of the entries that go with each watch
+    std::unordered_map<int, std::set<std::string>> dependents;
+  };
+
+  // What a client of serve () gets for one line of request
+  inline void
+  answer_request (const std::string &line,
+                  resolution_cache &cache,
+                  std::string &reply)
+  {
+    const auto &formats = output_formats ();
+    const std::size_t space = line.find (' ');
+    std::size_t i = 0;
+
+    if (space != std::string::npos)
+      while (i < formats.size () && line.compare (0, space, formats[i].name))
+        ++i;
+
+    if (space == std::string::npos || i == formats.size ())
+      {
+        reply.append ("error Requests are FORMAT FOLDER\n");
+        return;
+      }
+
+    try
+      {
+        const std::string &output = cache.render (line.substr (space + 1),
+                                                  i);
+
+        reply.append ("ok ").append (std::to_string (output.size ()))
+          .append ("\n").append (output);
+      }
+    catch (const std::exception &ex)
+      {
+        reply.append ("error ").append (ex.what ()).append ("\n");
+      }
+  }
+
+  // Reads what a client sent and answers its complete lines.  Returns
+  // false once the client is gone or sends a line too long to be a
+  // request.
+  inline bool
+  answer_client (int fd,
+                 std::string &input,
+                 resolution_cache &cache)
+  {
+    char block[4096];
+    ssize_t got = read (fd, block, sizeof (block));
+
+    if (got <= 0)
+      return got < 0 && errno == EINTR;
+
+    input.append (block, got);
+
+    std::string reply;
+    std::size_t start = 0;
+    std::size_t end;
+
+    while ((end = input.find ('\n', start)) != std::string::npos)
+      {
+        answer_request (input.substr (start, end - start), cache, reply);
+        start = end + 1;
+      }
+
+    input.erase (0, start);
+
+    if (input.size () > 65536)
+      return false;
+
+    const char *p = reply.data ();
+    std::size_t left = reply.size ();
+
+    while (left)
+      {
+        ssize_t sent = send (fd, p, left, MSG_NOSIGNAL);
+
+        if (sent >= 0)
+          {
+            p += sent;
+            left -= sent;
+          }
+        else if (errno != EINTR)
+          return false;
+      }
+
+    return true;
+  }
+
+  // Answers requests for a resolution_cache on a Unix socket at path
+  // until stop is set, which the signal handlers for SIGINT and SIGTERM
+  // should do.  Those signals are only let in while waiting.  Each
+  // request is a line with the name of an output format and a folder,
+  // answered with "ok SIZE" on a line and SIZE bytes of the output, or
+  // with "error MESSAGE" on a line.  A client can send any number of
+  // requests on its connection.
+  inline void
+  serve (const std::string &path,
+         const volatile std::sig_atomic_t &stop)
+  {
+    struct sockaddr_un address {};
+
+    if (path.size () >= sizeof (address.sun_path))
+      throw environment_exception {path + " is too long for a socket"};
+
+    address.sun_family = AF_UNIX;
+    std::memcpy (address.sun_path, path.c_str (), path.size () + 1);
+
+    const auto *name = reinterpret_cast<const struct sockaddr *> (&address);
+    int listener = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (listener < 0)
+      throw system_failure ("Creating the socket", path, errno);
+
+    int error = bind (listener, name, sizeof (address)) ? errno : 0;
+
+    if (error == EADDRINUSE)
+      {
+        // Take over a socket nobody listens on any more
+        int probe = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool stale = probe >= 0 && connect (probe, name, sizeof (address))
+          && errno == ECONNREFUSED;
+
+        if (probe >= 0)
+          close (probe);
+
+        if (stale && !unlink (path.c_str ()))
+          error = bind (listener, name, sizeof (address)) ? errno : 0;
+      }
+
+    if (!error && listen (listener, SOMAXCONN))
+      error = errno;
+
+    if (error)
+      {
+        close (listener);
+        throw system_failure ("Listening on", path, error);
+      }
+
+    sigset_t blocked;
+    sigset_t original;
+    sigemptyset (&blocked);
+    sigaddset (&blocked, SIGINT);
+    sigaddset (&blocked, SIGTERM);
+    sigprocmask (SIG_BLOCK, &blocked, &original);
+
+    sigset_t waiting {original};
+    sigdelset (&waiting, SIGINT);
+    sigdelset (&waiting, SIGTERM);
+
+    struct client
+    {
+      int fd;
+      std::string input;
+    };
+
+    std::vector<client> clients;
+    std::vector<struct pollfd> fds;
+
+    const auto finish = [&] () -> void {
+      for (const auto &c : clients)
+        close (c.fd);
+
+      close (listener);
+      unlink (path.c_str ());
+      sigprocmask (SIG_SETMASK, &original, nullptr);
+    };
+
+    try
+      {
+        resolution_cache cache;
+
+        while (!stop)
+          {
+            fds.assign ({{listener, POLLIN, 0},
+                         {cache.descriptor (), POLLIN, 0}});
+
+            for (const auto &c : clients)
+              fds.push_back ({c.fd, POLLIN, 0});
+
+            if (ppoll (fds.data (), fds.size (), nullptr, &waiting) < 0)
+              {
+                if (errno == EINTR)
+                  continue;
+
+                throw environment_exception {"Waiting for requests "
+                                             "failed: "
+                                             + errno_message (errno)};
+              }
+
+            // Even without an event yet, so that no answer is older
+            // than a change that was done before the request came
+            cache.update ();
+
+            for (std::size_t i = clients.size (); i-- > 0;)
+              if (fds[i + 2].revents
+                  && !answer_client (clients[i].fd, clients[i].input,
+                                     cache))
+                {
+                  close (clients[i].fd);
+                  clients.erase (clients.begin () + i);
+                }
+
+            if (fds[0].revents & POLLIN)
+              {
+                int fd = accept4 (listener, nullptr, nullptr,
+                                  SOCK_CLOEXEC);
+
+                if (fd >= 0)
+                  {
+                    // A client that does not read its answers must not
+                    // hold up the others for long
+                    const struct timeval timeout {1, 0};
+                    setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                                sizeof (timeout));
+                    clients.push_back ({fd, {}});
+                  }
+              }
+          }
+      }
+    catch (...)
+      {
+        finish ();
+        throw;
+      }
+
+    finish ();
+  }
+}
+
+#endif /* CENV_HH */
@@ -0,0 +1,1398 @@
+/* CENV - C/C++ environments
+ *
+ * Copyright 2020  Jakub Kaszycki
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The command line program and the functions of libcenv.h, on top of
+// cenv.hh
+
+#include "config.h"
+
+#include "cenv.hh"
+#include "libcenv.h"
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <libgen.h>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// The options that describe an environment, accepted in every mode
+#define ENVIRONMENT_OPTIONS "b:C:dD:e:E:f:i:I:l:Lm:np:P:r:RsT:x"
+
+struct options
+{
+  cenv::config cfg {};
+  bool default_configs {true};
+  unsigned jobs {0};
+  bool link_files {false};
+  std::string store;
+};
+
+inline void
+print_usage (std::ostream &stream)
+{
+  stream << "Usage: cenv [options...] folder\n"
+            "       cenv batch [-j <JOBS>] [options...] manifest\n"
+            "       cenv exec [options...] folder [--] command [args...]\n"
+            "       cenv refresh [options...] folder\n"
+            "       cenv regenerate [--stats] folder\n"
+            "       cenv clone [-H] source destination\n"
+            "       cenv index-libs [options...] folder\n"
+            "       cenv index-headers [options...] folder\n"
+            "       cenv pkgconfig-cache [options...] folder\n"
+            "       cenv subst [-D <KEY>=<VAL>...] < input > output\n"
+            "       cenv serve socket\n"
+            "       cenv store add [-o <STORE>] folder\n";
+}
+
+inline void
+print_help (void)
+{
+  print_usage (std::cout);
+
+  std::cout << "Options:\n"
+               "   -b <FOLDER>    - Go on top of the environment in FOLDER\n"
+               "   -C <CACHE>     - Keep a ccache or sccache cache in the\n"
+               "                    folder and use it as compiler launcher\n"
+               "   -d             - Create the directories the suffixes\n"
+               "                    name below the root\n"
+               "   -D <KEY>=<VAL> - Add a substition variable\n"
+               "   -e <SUFFIX>    - Add an executable suffix\n"
+               "   -E <KEY>=<VAL> - Add an extra environment variable\n"
+               "   -f <FORMAT>    - Also write the environment as FORMAT:\n"
+               "                    sh, fish, env, json, compile-flags,\n"
+               "                    hook or all\n"
+               "   -h             - Print this help text\n"
+               "   -i <SUFFIX>    - Add an include suffix\n"
+               "   -I <SUFFIX>    - Add an info suffix\n"
+               "   -l <SUFFIX>    - Add a library suffix\n"
+               "   -L             - Write cc and c++ launchers instead of\n"
+               "                    setting LD_LIBRARY_PATH\n"
+               "   -m <SUFFIX>    - Add a manpage suffix\n"
+               "   -n             - Turn off default configs\n"
+               "   -p <PROMPT>    - Choose the prompt text\n"
+               "   -P <SUFFIX>    - Add a pkg-config suffix\n"
+               "   -r <ROOT>      - Choose the root directory\n"
+               "   -R             - Make the scripts find the folder from\n"
+               "                    where they are, so that it can move\n"
+               "   -s             - Save and restore the variables in a\n"
+               "                    single block (needs bash 4.4)\n"
+               "   -T <TRIPLE>    - Also write the outputs with mach_type\n"
+               "                    set to TRIPLE, as activate-TRIPLE...\n"
+               "   -x             - Leave out directories that do not exist\n"
+               "   -v             - Print the version\n"
+               "   --stats        - Report the time spent in each phase,\n"
+               "                    the bytes written, the templates\n"
+               "                    expanded and the variable lookups\n"
+               "                    on the standard error when done\n"
+               "\n"
+               "Output formats:\n"
+               "   The folder always gets the bash script activate.  -f sh\n"
+               "   adds activate.sh for POSIX shells, -f fish adds\n"
+               "   activate.fish, -f env adds cenv.env with KEY=VALUE lines,\n"
+               "   -f json adds cenv.json and -f compile-flags adds the\n"
+               "   compile_flags.txt clangd reads, with the include\n"
+               "   directories.  -f hook adds cenv-hook.sh, for a cd or\n"
+               "   prompt hook of a POSIX shell to source each time: it\n"
+               "   does nothing while the environment it applied has not\n"
+               "   changed, and otherwise only sets the variables whose\n"
+               "   values differ.  Each -T writes the same files again for\n"
+               "   another mach_type, with the triple after the name:\n"
+               "   activate-TRIPLE, activate-TRIPLE.sh and so on.\n"
+               "   Without -D mach_type, the first -T is also the one of the\n"
+               "   plain files.\n"
+               "\n"
+               "Compiler caches:\n"
+               "   The scripts export CENV_FINGERPRINT, a hash of the search\n"
+               "   paths and variables that does not depend on where the\n"
+               "   environment is.  With -C ccache, CCACHE_DIR points into\n"
+               "   .cenv and CCACHE_BASEDIR at the root; with -C sccache,\n"
+               "   SCCACHE_DIR points into .cenv and the fingerprint goes\n"
+               "   into SCCACHE_C_CUSTOM_CACHE_BUSTER.  Both set the CMake\n"
+               "   compiler launcher variables.\n"
+               "\n"
+               "Layered environments:\n"
+               "   Each -b adds a base, later ones above earlier ones.  The\n"
+               "   scripts set the variables of all of them at once: the\n"
+               "   search paths of the bases follow those of the folder,\n"
+               "   without duplicates, and their other variables only fill\n"
+               "   in what the folder does not set.  Refresh the folder\n"
+               "   after changing a base.\n"
+               "\n"
+               "Compiler launchers:\n"
+               "   With -L, .cenv/bin gets cc and c++, which run the next\n"
+               "   compiler of that name in PATH with the include\n"
+               "   directories as -isystem and, when linking, the library\n"
+               "   directories as -L and as the run path of the output.  The\n"
+               "   flags are in .cenv/cc.rsp, .cenv/c++.rsp and\n"
+               "   .cenv/link.rsp; each -T variant gets its own in\n"
+               "   .cenv/TRIPLE.  Binaries built that way find their\n"
+               "   libraries by themselves, so the scripts leave\n"
+               "   LD_LIBRARY_PATH and DYLD_LIBRARY_PATH alone.\n"
+               "\n"
+               "Batch mode:\n"
+               "   Each non-empty line of the manifest that does not start\n"
+               "   with # describes one environment as [options...] folder,\n"
+               "   with the options above.  Words are separated by blanks; a\n"
+               "   backslash escapes the next character.  Options given on\n"
+               "   the command line apply to every environment.  Use - to\n"
+               "   read the manifest from the standard input.\n"
+               "   -j <JOBS>      - Create up to JOBS environments at once\n"
+               "\n"
+               "Exec mode:\n"
+               "   Runs the command with the variables the activate script\n"
+               "   of the folder would set, without a shell.  The settings\n"
+               "   come from the folder, with the given options on top.\n"
+               "\n"
+               "Refresh mode:\n"
+               "   Writes the activate script of the folder again, with the\n"
+               "   settings it was created with and the given options on\n"
+               "   top.  Use it with -x after installing into the folder.\n"
+               "   Each environment keeps its settings in .cenv/manifest.\n"
+               "\n"
+               "Regenerate mode:\n"
+               "   Writes the files of the folder again from its saved\n"
+               "   settings alone.\n"
+               "\n"
+               "Clone mode:\n"
+               "   Copies an environment to a new folder and writes its\n"
+               "   files there again, with the settings that name the\n"
+               "   source moved to the destination.  Files share their\n"
+               "   blocks with the originals where the file system allows.\n"
+               "   -H             - Hard link the files outside .cenv\n"
+               "                    instead, only for trees nobody writes\n"
+               "\n"
+               "Index-libs mode:\n"
+               "   Links the shared libraries of the library directories\n"
+               "   into .cenv/lib in the folder and refreshes it, so that\n"
+               "   LD_LIBRARY_PATH and DYLD_LIBRARY_PATH only hold the\n"
+               "   index.  Run it again after installing libraries.\n"
+               "\n"
+               "Index-headers mode:\n"
+               "   Merges the include directories into a tree of links in\n"
+               "   .cenv/include, which replaces them in C_INCLUDE_PATH and\n"
+               "   CPLUS_INCLUDE_PATH, and writes a clang VFS overlay of it\n"
+               "   to .cenv/include.yaml.  The activate script exports\n"
+               "   CENV_CLANG_FLAGS to pass the overlay to clang.  The first\n"
+               "   directory providing a header wins, so #include_next does\n"
+               "   not see the others.\n"
+               "\n"
+               "Pkgconfig-cache mode:\n"
+               "   Reads every .pc file in the pkg-config directories and\n"
+               "   writes .cenv/bin/pkg-config, which goes first in PATH.\n"
+               "   It answers --modversion, --cflags, --libs and --exists\n"
+               "   for those modules without reading any file and passes\n"
+               "   anything else to the next pkg-config in PATH.  Run it\n"
+               "   again after installing packages.\n"
+               "\n"
+               "Subst mode:\n"
+               "   Copies the standard input to the standard output with\n"
+               "   the variables given with -D substituted, using the same\n"
+               "   syntax as the suffixes.\n"
+               "\n"
+               "Serve mode:\n"
+               "   Answers requests on a Unix socket until interrupted,\n"
+               "   keeping every environment it was asked about in memory\n"
+               "   and forgetting it when cenv writes its files or those of\n"
+               "   a base again, in any mode.  A request is a line with an\n"
+               "   output format and a folder, like \"compile-flags\n"
+               "   /path/to/folder\".  The answer is a line \"ok SIZE\"\n"
+               "   followed by SIZE bytes of output, or a line \"error\n"
+               "   MESSAGE\".  Several requests can go over one connection.\n"
+               "\n"
+               "Store mode:\n"
+               "   cenv store add moves the files below the directories the\n"
+               "   suffixes of the folder name into a store shared by every\n"
+               "   environment on the file system, and links the files of\n"
+               "   the same contents to one copy there, so that they share\n"
+               "   an inode, the disk space and the cached pages.  Stored\n"
+               "   files are read-only: replace them, do not write to them.\n"
+               "   -o <STORE>     - Use the store in STORE instead of the\n"
+               "                    one CENV_STORE names\n";
+}
+
+inline void
+print_error_usage ()
+{
+  print_usage (std::cerr);
+
+  std::cerr << "Run cenv -h to get the possible options\n";
+}
+
+// Returns -1 when the caller should go on, otherwise the exit status.
+// Usage errors are described in error.
+inline int
+parse_options (int argc,
+               char **argv,
+               const char *optstring,
+               options &opts,
+               std::string &error)
+{
+  cenv::config &cfg = opts.cfg;
+
+  // Start over, parse_options may run more than once
+  optind = 0;
+
+  // Every mode takes these, they have no short form
+  static const struct option long_options[] {
+    {"stats", no_argument, nullptr, 'S'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long (argc, argv, optstring, long_options, nullptr))
+         != -1)
+    switch (opt)
+      {
+      case 'S':
+        cenv::stats ().enabled = true;
+        break;
+
+      case 'b':
+        cfg.bases.emplace_back (optarg);
+        break;
+
+      case 'C':
+        if (!cenv::find_compiler_cache (optarg))
+          {
+            error = std::string {"Unknown compiler cache "} + optarg;
+            return 2;
+          }
+
+        cfg.compiler_cache = optarg;
+        break;
+
+      case 'd':
+        cfg.make_layout = true;
+        break;
+
+      case 'D':
+        {
+          char *p = strchr (optarg, '=');
+
+          if (!p)
+            {
+              error = "The argument to -D should contain a key and a value";
+              return 2;
+            }
+
+          cfg.variables[std::string {optarg, p}] = std::string {p + 1};
+          break;
+        }
+
+      case 'e':
+        cfg.add_suffix (cfg.executable_suffixes, optarg);
+        break;
+
+      case 'E':
+        {
+          char *p = strchr (optarg, '=');
+
+          if (!p)
+            {
+              error = "The argument to -E should contain a key and a value";
+              return 2;
+            }
+
+          cfg.environment_variables[std::string {optarg, p}]
+            = std::string {p + 1};
+          break;
+        }
+
+      case 'f':
+        {
+          const auto &formats = cenv::output_formats ();
+          const bool all = !strcmp (optarg, "all");
+          std::size_t i;
+
+          for (i = 0; i < formats.size (); ++i)
+            if (all || !strcmp (optarg, formats[i].name))
+              {
+                cfg.formats |= 1u << i;
+
+                if (!all)
+                  break;
+              }
+
+          if (!all && i == formats.size ())
+            {
+              error = std::string {"Unknown output format "} + optarg;
+              return 2;
+            }
+
+          break;
+        }
+
+      case 'h':
+        print_help ();
+        return 0;
+
+      case 'H':
+        opts.link_files = true;
+        break;
+
+      case 'i':
+        cfg.add_suffix (cfg.include_suffixes, optarg);
+        break;
+
+      case 'I':
+        cfg.add_suffix (cfg.info_suffixes, optarg);
+        break;
+
+      case 'j':
+        {
+          char *end;
+          unsigned long jobs = strtoul (optarg, &end, 10);
+
+          if (*optarg == '\0' || *end != '\0' || jobs == 0 || jobs > 4096)
+            {
+              error = "The argument to -j should be a positive number";
+              return 2;
+            }
+
+          opts.jobs = jobs;
+          break;
+        }
+
+      case 'l':
+        cfg.add_suffix (cfg.library_suffixes, optarg);
+        break;
+
+      case 'm':
+        cfg.add_suffix (cfg.manpage_suffixes, optarg);
+        break;
+
+      case 'L':
+        cfg.compiler_launchers = true;
+        break;
+
+      case 'n':
+        opts.default_configs = false;
+        break;
+
+      case 'o':
+        opts.store = optarg;
+        break;
+
+      case 'p':
+        cfg.prompt = optarg;
+        cfg.prompt_set = true;
+        break;
+
+      case 'P':
+        cfg.add_suffix (cfg.pkg_config_suffixes, optarg);
+        break;
+
+      case 'r':
+        cfg.root = optarg;
+        cfg.root_set = true;
+        break;
+
+      case 'R':
+        cfg.relocatable = true;
+        break;
+
+      case 's':
+        cfg.snapshot_variables = true;
+        break;
+
+      case 'T':
+        if (!*optarg || strchr (optarg, '/') || !strcmp (optarg, ".")
+            || !strcmp (optarg, ".."))
+          {
+            error = "The argument to -T should be a target triple";
+            return 2;
+          }
+
+        cfg.mach_types.emplace_back (optarg);
+        break;
+
+      case 'x':
+        cfg.prune_missing = true;
+        break;
+
+      case 'v':
+        std::cout << VERSION << '\n';
+        return 0;
+
+      case '?':
+        if (optopt)
+          error = std::string {"Unknown option -"} + (char) optopt;
+        else
+          error = std::string {"Unknown option "} + argv[optind - 1];
+        return 2;
+
+      case ':':
+        error = std::string {"Missing argument for option -"}
+          + (char) optopt;
+        return 2;
+
+      default:
+        abort ();
+      }
+
+  return -1;
+}
+
+// Creates the environment, which also saves its settings for refresh.
+// Returns false if it was up to date.
+inline bool
+create (options &opts)
+{
+  return cenv::create_environment (opts.cfg, opts.default_configs);
+}
+
+// Splits a manifest line into words.  Returns false for lines without
+// any, which are blank or comments.
+inline bool
+split_manifest_line (const std::string &line,
+                     std::vector<std::string> &words)
+{
+  words.clear ();
+
+  bool in_word = false;
+  for (std::size_t i = 0; i < line.size (); ++i)
+    {
+      char ch = line[i];
+
+      if (ch == ' ' || ch == '\t' || ch == '\r')
+        {
+          in_word = false;
+          continue;
+        }
+
+      if (!in_word)
+        {
+          if (words.empty () && ch == '#')
+            break;
+
+          words.emplace_back ();
+          in_word = true;
+        }
+
+      if (ch == '\\' && i + 1 < line.size ())
+        ch = line[++i];
+
+      words.back ().push_back (ch);
+    }
+
+  return !words.empty ();
+}
+
+inline int
+run_batch (int argc,
+           char **argv)
+{
+  options base;
+  std::string error;
+
+  int status = parse_options (argc, argv, "+:" ENVIRONMENT_OPTIONS "hj:v",
+                              base, error);
+  if (status == 2)
+    {
+      print_error_usage ();
+      std::cerr << error << '\n';
+    }
+
+  if (status >= 0)
+    return status;
+
+  if (optind != (argc - 1))
+    {
+      print_error_usage ();
+      std::cerr << "Exactly one manifest is required\n";
+      return 2;
+    }
+
+  const std::string manifest_name {argv[optind]};
+  std::ifstream manifest_file;
+  std::istream *manifest = &std::cin;
+
+  if (manifest_name != "-")
+    {
+      manifest_file.open (manifest_name);
+
+      if (!manifest_file.is_open ())
+        {
+          std::cerr << "Opening the manifest " << manifest_name
+                    << " failed: " << std::strerror (errno) << '\n';
+          return 1;
+        }
+
+      manifest = &manifest_file;
+    }
+
+  // Parse everything up front, getopt is not reentrant
+  struct entry
+  {
+    options opts;
+    std::string error;
+    bool changed;
+  };
+
+  std::vector<entry> entries;
+  std::string line;
+  std::vector<std::string> words;
+  unsigned long line_number = 0;
+
+  while (std::getline (*manifest, line))
+    {
+      ++line_number;
+
+      if (!split_manifest_line (line, words))
+        continue;
+
+      entries.push_back ({base, {}, false});
+      entry &e = entries.back ();
+
+      std::vector<char *> entry_argv;
+      entry_argv.push_back (argv[0]);
+      for (auto &word : words)
+        entry_argv.push_back (&word[0]);
+      entry_argv.push_back (nullptr);
+
+      int entry_argc = entry_argv.size () - 1;
+      status = parse_options (entry_argc, entry_argv.data (),
+                              "+:" ENVIRONMENT_OPTIONS, e.opts, error);
+
+      if (status < 0 && optind != (entry_argc - 1))
+        {
+          status = 2;
+          error = "Exactly one folder name is required";
+        }
+
+      if (status >= 0)
+        {
+          std::ostringstream msg_builder;
+          msg_builder << manifest_name << ':' << line_number << ": "
+                      << error;
+          e.error = msg_builder.str ();
+          e.opts.cfg.folder = words.back ();
+        }
+      else
+        e.opts.cfg.folder = entry_argv[optind];
+    }
+
+  if (manifest->bad ())
+    {
+      std::cerr << "Reading the manifest " << manifest_name << " failed\n";
+      return 1;
+    }
+
+  // Hand out the entries to the workers one at a time
+  std::atomic<std::size_t> next {0};
+
+  const auto worker = [&] () -> void {
+    for (;;)
+      {
+        std::size_t i = next++;
+
+        if (i >= entries.size ())
+          break;
+
+        entry &e = entries[i];
+
+        if (!e.error.empty ())
+          continue;
+
+        try
+          {
+            e.changed = create (e.opts);
+          }
+        catch (const std::exception &ex)
+          {
+            e.error = ex.what ();
+          }
+      }
+  };
+
+  unsigned jobs = base.jobs ? base.jobs : std::thread::hardware_concurrency ();
+  if (jobs == 0)
+    jobs = 1;
+  if (jobs > entries.size ())
+    jobs = entries.size ();
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < jobs; ++i)
+    workers.emplace_back (worker);
+
+  worker ();
+
+  for (auto &t : workers)
+    t.join ();
+
+  status = 0;
+  for (const auto &e : entries)
+    if (e.error.empty ())
+      std::cout << e.opts.cfg.folder
+                << (e.changed ? ": created\n" : ": up to date\n");
+    else
+      {
+        std::cerr << e.opts.cfg.folder << ": " << e.error << '\n';
+        status = 1;
+      }
+
+  return status;
+}
+
+// Reads the settings create saved for the folder.  They include the
+// defaults, so these are not added again.
+inline void
+load_saved (const std::string &folder,
+            options &opts)
+{
+  cenv::load_manifest (folder, opts.cfg);
+  opts.default_configs = false;
+}
+
+// Replaces the options with the saved settings of the folder and the
+// command line, which has been checked already, on top
+inline int
+reload_options (int argc,
+                char **argv,
+                const std::string &folder,
+                options &opts)
+{
+  try
+    {
+      opts = options {};
+      load_saved (folder, opts);
+    }
+  catch (const std::exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+      return 1;
+    }
+
+  std::string error;
+  parse_options (argc, argv, "+:" ENVIRONMENT_OPTIONS "hv", opts, error);
+  opts.cfg.folder = folder;
+  return -1;
+}
+
+inline int
+run_exec (int argc,
+          char **argv)
+{
+  options opts;
+  std::string error;
+
+  int status = parse_options (argc, argv, "+:" ENVIRONMENT_OPTIONS "hv",
+                              opts, error);
+  if (status == 2)
+    {
+      print_error_usage ();
+      std::cerr << error << '\n';
+    }
+
+  if (status >= 0)
+    return status;
+
+  int command = optind + 1;
+
+  if (command < argc && !std::strcmp (argv[command], "--"))
+    ++command;
+
+  if (command >= argc)
+    {
+      print_error_usage ();
+      std::cerr << "A folder name and a command are required\n";
+      return 2;
+    }
+
+  status = reload_options (argc, argv, argv[optind], opts);
+  if (status >= 0)
+    return status;
+
+  // Like a shell, 127 when the command is not found and 126 when it
+  // cannot be run; a broken environment is an error like in any mode
+  try
+    {
+      cenv::open_environment (opts.cfg, false);
+      cenv::exec_environment (opts.cfg, argv + command);
+    }
+  catch (const cenv::exec_exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+      return ex.error () == ENOENT ? 127 : 126;
+    }
+  catch (const std::exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+    }
+
+  return 1;
+}
+
+// Parses the command line of a mode that works on an existing folder.
+// Its options go on top of the saved settings.
+inline int
+parse_saved_options (int argc,
+                     char **argv,
+                     options &opts)
+{
+  std::string error;
+
+  // Check the command line and find the folder first
+  int status = parse_options (argc, argv, "+:" ENVIRONMENT_OPTIONS "hv",
+                              opts, error);
+  if (status == 2)
+    {
+      print_error_usage ();
+      std::cerr << error << '\n';
+    }
+
+  if (status >= 0)
+    return status;
+
+  if (optind != (argc - 1))
+    {
+      print_error_usage ();
+      std::cerr << "Exactly one folder name is required\n";
+      return 2;
+    }
+
+  return reload_options (argc, argv, argv[optind], opts);
+}
+
+inline int
+run_refresh (int argc,
+             char **argv)
+{
+  options opts;
+
+  int status = parse_saved_options (argc, argv, opts);
+  if (status >= 0)
+    return status;
+
+  try
+    {
+      create (opts);
+    }
+  catch (const std::exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+      return 1;
+    }
+
+  return 0;
+}
+
+// Refresh without options, which skips the command line parser
+inline int
+run_regenerate (int argc,
+                char **argv)
+{
+  options opts;
+  std::string error;
+
+  // Only for --stats, everything else comes from the folder
+  int status = parse_options (argc, argv, "+:hv", opts, error);
+  if (status == 2)
+    {
+      print_error_usage ();
+      std::cerr << error << '\n';
+    }
+
+  if (status >= 0)
+    return status;
+
+  if (optind != (argc - 1))
+    {
+      print_error_usage ();
+      std::cerr << "Exactly one folder name is required\n";
+      return 2;
+    }
+
+  try
+    {
+      options saved;
+      load_saved (argv[optind], saved);
+      create (saved);
+    }
+  catch (const std::exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+      return 1;
+    }
+
+  return 0;
+}
+
+inline int
+run_subst (int argc,
+           char **argv)
+{
+  options opts;
+  std::string error;
+
+  int status = parse_options (argc, argv, "+:D:hv", opts, error);
+  if (status == 2)
+    {
+      print_error_usage ();
+      std::cerr << error << '\n';
+    }
+
+  if (status >= 0)
+    return status;
+
+  if (optind != argc)
+    {
+      print_error_usage ();
+      std::cerr << "subst takes no arguments besides options\n";
+      return 2;
+    }
+
+  try
+    {
+      cenv::substitute_vars (0, 1, opts.cfg.variables);
+    }
+  catch (const std::exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+      return 1;
+    }
+
+  return 0;
+}
+
+inline int
+run_clone (int argc,
+           char **argv)
+{
+  options opts;
+  std::string error;
+
+  int status = parse_options (argc, argv, "+:Hhv", opts, error);
+  if (status == 2)
+    {
+      print_error_usage ();
+      std::cerr << error << '\n';
+    }
+
+  if (status >= 0)
+    return status;
+
+  if (argc - optind != 2)
+    {
+      print_error_usage ();
+      std::cerr << "A source and a destination folder are required\n";
+      return 2;
+    }
+
+  try
+    {
+      std::size_t count = cenv::clone_environment
+        (argv[optind], argv[optind + 1], opts.link_files);
+
+      std::cout << "Cloned " << count << " files to " << argv[optind + 1]
+                << '\n';
+    }
+  catch (const std::exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+      return 1;
+    }
+
+  return 0;
+}
+
+// Builds an index of the environment and refreshes the activate script
+// so that it uses the index
+inline int
+run_index (int argc,
+           char **argv,
+           std::size_t (*build) (const cenv::config &),
+           const char *index,
+           const char *what)
+{
+  options opts;
+
+  int status = parse_saved_options (argc, argv, opts);
+  if (status >= 0)
+    return status;
+
+  try
+    {
+      cenv::config cfg {opts.cfg};
+      cenv::open_environment (cfg, false);
+      std::size_t count = build (cfg);
+
+      create (opts);
+
+      std::cout << "Indexed " << count << ' ' << what << " in "
+                << cfg.index_path (index) << '\n';
+    }
+  catch (const std::exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+      return 1;
+    }
+
+  return 0;
+}
+
+static volatile std::sig_atomic_t stop_serving;
+
+inline void
+stop_serve (int)
+{
+  stop_serving = 1;
+}
+
+inline int
+run_serve (int argc,
+           char **argv)
+{
+  options opts;
+  std::string error;
+
+  int status = parse_options (argc, argv, "+:hv", opts, error);
+  if (status == 2)
+    {
+      print_error_usage ();
+      std::cerr << error << '\n';
+    }
+
+  if (status >= 0)
+    return status;
+
+  if (argc - optind != 1)
+    {
+      print_error_usage ();
+      std::cerr << "Exactly one socket path is required\n";
+      return 2;
+    }
+
+  // Without SA_RESTART, so that waiting stops
+  struct sigaction action {};
+  action.sa_handler = stop_serve;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGINT, &action, nullptr);
+  sigaction (SIGTERM, &action, nullptr);
+
+  try
+    {
+      cenv::serve (argv[optind], stop_serving);
+    }
+  catch (const std::exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+      return 1;
+    }
+
+  return 0;
+}
+
+inline int
+run_store (int argc,
+           char **argv)
+{
+  if (argc < 2 || std::strcmp (argv[1], "add"))
+    {
+      print_error_usage ();
+      std::cerr << "The store command should be add\n";
+      return 2;
+    }
+
+  options opts;
+  std::string error;
+
+  int status = parse_options (argc - 1, argv + 1, "+:o:hv", opts, error);
+  if (status == 2)
+    {
+      print_error_usage ();
+      std::cerr << error << '\n';
+    }
+
+  if (status >= 0)
+    return status;
+
+  if (optind != (argc - 2))
+    {
+      print_error_usage ();
+      std::cerr << "Exactly one folder name is required\n";
+      return 2;
+    }
+
+  if (opts.store.empty ())
+    {
+      const char *store = std::getenv ("CENV_STORE");
+
+      if (!store || !*store)
+        {
+          print_error_usage ();
+          std::cerr << "Give the store with -o or CENV_STORE\n";
+          return 2;
+        }
+
+      opts.store = store;
+    }
+
+  try
+    {
+      cenv::config cfg;
+      cenv::load_manifest (argv[optind + 1], cfg);
+      cenv::open_environment (cfg, false);
+
+      const cenv::store_counts counts = cenv::add_to_store (cfg, opts.store);
+
+      std::cout << "Stored " << counts.files << " files of " << cfg.folder
+                << " in " << opts.store << ", sharing " << counts.bytes
+                << " bytes\n";
+    }
+  catch (const std::exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+      return 1;
+    }
+
+  return 0;
+}
+
+inline int
+run (int argc,
+     char **argv)
+{
+  if (argc > 1 && !std::strcmp (argv[1], "refresh"))
+    return run_refresh (argc - 1, argv + 1);
+
+  if (argc > 1 && !std::strcmp (argv[1], "regenerate"))
+    return run_regenerate (argc - 1, argv + 1);
+
+  if (argc > 1 && !std::strcmp (argv[1], "clone"))
+    return run_clone (argc - 1, argv + 1);
+
+  if (argc > 1 && !std::strcmp (argv[1], "index-libs"))
+    return run_index (argc - 1, argv + 1, cenv::build_library_index, "lib",
+                      "libraries");
+
+  if (argc > 1 && !std::strcmp (argv[1], "index-headers"))
+    return run_index (argc - 1, argv + 1, cenv::build_header_index,
+                      "include", "headers");
+
+  if (argc > 1 && !std::strcmp (argv[1], "pkgconfig-cache"))
+    return run_index (argc - 1, argv + 1, cenv::build_pkgconfig_cache,
+                      "bin/pkg-config", "pkg-config modules");
+
+  if (argc > 1 && !std::strcmp (argv[1], "subst"))
+    return run_subst (argc - 1, argv + 1);
+
+  if (argc > 1 && !std::strcmp (argv[1], "batch"))
+    return run_batch (argc - 1, argv + 1);
+
+  if (argc > 1 && !std::strcmp (argv[1], "exec"))
+    return run_exec (argc - 1, argv + 1);
+
+  if (argc > 1 && !std::strcmp (argv[1], "serve"))
+    return run_serve (argc - 1, argv + 1);
+
+  if (argc > 1 && !std::strcmp (argv[1], "store"))
+    return run_store (argc - 1, argv + 1);
+
+  options opts;
+  std::string error;
+
+  int status = parse_options (argc, argv, "+:" ENVIRONMENT_OPTIONS "hv",
+                              opts, error);
+  if (status == 2)
+    {
+      print_error_usage ();
+      std::cerr << error << '\n';
+    }
+
+  if (status >= 0)
+    return status;
+
+  if (optind != (argc - 1))
+    {
+      print_error_usage ();
+      std::cerr << "Exactly one folder name is required\n";
+      return 2;
+    }
+
+  opts.cfg.folder = argv[optind];
+
+  try
+    {
+      create (opts);
+    }
+  catch (const std::exception &ex)
+    {
+      std::cerr << ex.what () << '\n';
+      return 1;
+    }
+
+  return 0;
+}
+
+int
+cenv_main (int argc,
+           char **argv)
+{
+  // Batch mode writes from several threads
+  cenv::process_umask ();
+  int status = run (argc, argv);
+
+  if (cenv::stats ().enabled)
+    cenv::print_statistics (std::cerr);
+
+  return status;
+}
+
+struct cenv_environment
+{
+  cenv::resolved_environment env;
+  // What cenv_variable hands out, with the entries of search variables
+  // joined
+  std::vector<std::string> values;
+};
+
+namespace
+{
+  void
+  set_error (char *error,
+             std::size_t error_size,
+             const char *message)
+    noexcept
+  {
+    if (!error || !error_size)
+      return;
+
+    std::size_t length = std::min (std::strlen (message), error_size - 1);
+    std::memcpy (error, message, length);
+    error[length] = '\0';
+  }
+
+  // Runs fn, which returns a status, and turns whatever it throws into
+  // one with a message
+  template <typename Function>
+  int
+  guard (Function fn,
+         char *error,
+         std::size_t error_size)
+    noexcept
+  {
+    try
+      {
+        return fn ();
+      }
+    catch (const std::bad_alloc &)
+      {
+        set_error (error, error_size, "Out of memory");
+        return CENV_ERROR_MEMORY;
+      }
+    catch (const cenv::syntax_exception &ex)
+      {
+        set_error (error, error_size, ex.what ());
+        return CENV_ERROR_SYNTAX;
+      }
+    catch (const std::exception &ex)
+      {
+        set_error (error, error_size, ex.what ());
+        return CENV_ERROR_SYSTEM;
+      }
+  }
+
+  cenv_environment *
+  make_environment (cenv::resolved_environment env)
+  {
+    std::unique_ptr<cenv_environment> result
+      {new cenv_environment {std::move (env), {}}};
+
+    for (const auto &var : result->env.variables)
+      if (var.type == cenv::resolved_variable::kind::search)
+        result->values.push_back (var.joined ());
+      else
+        result->values.push_back (var.value);
+
+    return result.release ();
+  }
+}
+
+int
+cenv_resolve (int argc,
+              char **argv,
+              cenv_environment **env,
+              char *error,
+              size_t error_size)
+{
+  *env = nullptr;
+
+  return guard ([&] () -> int {
+    // getopt wants a program name in front
+    std::vector<char *> args {const_cast<char *> ("cenv")};
+    args.insert (args.end (), argv, argv + argc);
+    args.push_back (nullptr);
+
+    options opts;
+    std::string message;
+
+    int status = parse_options (argc + 1, args.data (),
+                                "+:" ENVIRONMENT_OPTIONS, opts, message);
+    if (status >= 0)
+      {
+        set_error (error, error_size, message.c_str ());
+        return CENV_ERROR_USAGE;
+      }
+
+    if (optind != argc)
+      {
+        set_error (error, error_size, "Exactly one folder name is required");
+        return CENV_ERROR_USAGE;
+      }
+
+    opts.cfg.folder = argv[argc - 1];
+    cenv::open_environment (opts.cfg, opts.default_configs);
+    *env = make_environment (opts.cfg.resolve ());
+    return CENV_OK;
+  }, error, error_size);
+}
+
+int
+cenv_load (const char *folder,
+           cenv_environment **env,
+           char *error,
+           size_t error_size)
+{
+  *env = nullptr;
+
+  return guard ([&] () -> int {
+    cenv::config cfg;
+    cenv::load_manifest (folder, cfg);
+    cenv::open_environment (cfg, false);
+    *env = make_environment (cfg.resolve ());
+    return CENV_OK;
+  }, error, error_size);
+}
+
+void
+cenv_environment_free (cenv_environment *env)
+{
+  delete env;
+}
+
+size_t
+cenv_variable_count (const cenv_environment *env)
+{
+  return env->env.variables.size ();
+}
+
+int
+cenv_variable (const cenv_environment *env,
+               size_t index,
+               const char **name,
+               const char **value,
+               enum cenv_variable_kind *kind)
+{
+  if (index >= env->env.variables.size ())
+    return CENV_ERROR_USAGE;
+
+  const auto &var = env->env.variables[index];
+
+  if (name)
+    *name = var.name.c_str ();
+
+  if (value)
+    *value = env->values[index].c_str ();
+
+  if (kind)
+    switch (var.type)
+      {
+      case cenv::resolved_variable::kind::prompt:
+        *kind = CENV_VARIABLE_PROMPT;
+        break;
+
+      case cenv::resolved_variable::kind::search:
+        *kind = CENV_VARIABLE_SEARCH;
+        break;
+
+      case cenv::resolved_variable::kind::literal:
+        *kind = CENV_VARIABLE_LITERAL;
+        break;
+      }
+
+  return CENV_OK;
+}
+
+int
+cenv_write (const cenv_environment *env,
+            const char *format,
+            char *buffer,
+            size_t *size)
+{
+  return guard ([&] () -> int {
+    for (const auto &f : cenv::output_formats ())
+      if (!std::strcmp (format, f.name))
+        {
+          cenv::buffer_streambuf streambuf {buffer, *size};
+          std::ostream out {&streambuf};
+          bool fits;
+
+          f.write (env->env, out);
+          fits = streambuf.size () <= *size;
+          *size = streambuf.size ();
+          return fits ? CENV_OK : CENV_ERROR_BUFFER;
+        }
+
+    return CENV_ERROR_USAGE;
+  }, nullptr, 0);
+}
+
+int
+cenv_substitute (const char *input,
+                 size_t input_size,
+                 const char *const *keys,
+                 const char *const *values,
+                 size_t count,
+                 char *buffer,
+                 size_t *size,
+                 char *error,
+                 size_t error_size)
+{
+  return guard ([&] () -> int {
+    cenv::variable_map variables;
+
+    for (std::size_t i = 0; i < count; ++i)
+      variables[keys[i]] = values[i];
+
+    cenv::buffer_writer writer {buffer, *size};
+    cenv::basic_substitution<cenv::buffer_writer> engine {variables, writer};
+    cenv::substitution_parser<cenv::basic_substitution<cenv::buffer_writer>>
+      parser {engine};
+
+    parser.feed (input, input + input_size);
+    parser.finish ();
+
+    bool fits = writer.size () <= *size;
+    *size = writer.size ();
+    return fits ? CENV_OK : CENV_ERROR_BUFFER;
+  }, error, error_size);
+}
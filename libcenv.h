@@ -0,0 +1,141 @@
+/* CENV - C/C++ environments
+ *
+ * Copyright 2020  Jakub Kaszycki
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The embeddable interface of cenv, for C and C++.  Nothing in it
+ * throws: every function that can fail returns one of the cenv_status
+ * codes and, where the caller passes a buffer for it, a message.
+ * Output goes to buffers of the caller, and an environment owns every
+ * string it hands out, so reading it allocates nothing. */
+
+#ifndef LIBCENV_H
+#define LIBCENV_H
+
+#include <stddef.h>
+
+#if defined (__GNUC__)
+#define CENV_API __attribute__ ((visibility ("default")))
+#else
+#define CENV_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum cenv_status
+{
+  CENV_OK = 0,
+  /* A system call failed, on a file of the environment for instance */
+  CENV_ERROR_SYSTEM,
+  /* A template does not parse or names an unknown variable */
+  CENV_ERROR_SYNTAX,
+  /* The options are not valid */
+  CENV_ERROR_USAGE,
+  /* Out of memory */
+  CENV_ERROR_MEMORY,
+  /* The buffer is too small, its size now holds the size needed */
+  CENV_ERROR_BUFFER
+};
+
+/* What the activate script does with a variable */
+enum cenv_variable_kind
+{
+  /* The value goes in front of the prompt */
+  CENV_VARIABLE_PROMPT,
+  /* The value goes in front of the variable, separated with a colon */
+  CENV_VARIABLE_SEARCH,
+  /* The value replaces the variable */
+  CENV_VARIABLE_LITERAL
+};
+
+/* A resolved environment, every template expanded and every directory
+ * found, as the activate script would set it */
+typedef struct cenv_environment cenv_environment;
+
+/* Resolves the environment that the command line cenv [options...]
+ * folder would create, without writing anything.  argv holds the
+ * options and the folder, which has to exist, without a program name.
+ * Parses the options with getopt, so it must not run alongside other
+ * users of getopt.  On failure, *env is null and the message goes to
+ * error, which may be null. */
+CENV_API int
+cenv_resolve (int argc,
+              char **argv,
+              cenv_environment **env,
+              char *error,
+              size_t error_size);
+
+/* Resolves an existing environment from its saved settings */
+CENV_API int
+cenv_load (const char *folder,
+           cenv_environment **env,
+           char *error,
+           size_t error_size);
+
+CENV_API void
+cenv_environment_free (cenv_environment *env);
+
+/* The variables in the order the scripts set them.  name and value
+ * stay valid until the environment is freed. */
+CENV_API size_t
+cenv_variable_count (const cenv_environment *env);
+
+CENV_API int
+cenv_variable (const cenv_environment *env,
+               size_t index,
+               const char **name,
+               const char **value,
+               enum cenv_variable_kind *kind);
+
+/* Writes one of the output formats to buffer, which holds *size bytes.
+ * The formats are the names -f takes, see cenv --help: bash, sh, fish,
+ * env, json, compile-flags and hook.  Any other name gives
+ * CENV_ERROR_USAGE.  *size becomes the size of the output, which is
+ * not terminated.  When that is more than the buffer holds, nothing
+ * useful is in it and CENV_ERROR_BUFFER comes back, so the call can be
+ * repeated with a buffer as large as *size. */
+CENV_API int
+cenv_write (const cenv_environment *env,
+            const char *format,
+            char *buffer,
+            size_t *size);
+
+/* Substitutes the variables in input as cenv subst does, with the
+ * definitions given as count pairs of key and value.  The output goes
+ * to buffer as with cenv_write. */
+CENV_API int
+cenv_substitute (const char *input,
+                 size_t input_size,
+                 const char *const *keys,
+                 const char *const *values,
+                 size_t count,
+                 char *buffer,
+                 size_t *size,
+                 char *error,
+                 size_t error_size);
+
+/* The cenv command line program */
+CENV_API int
+cenv_main (int argc,
+           char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBCENV_H */
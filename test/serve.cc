@@ -0,0 +1,210 @@
+/* CENV - C/C++ environments
+ *
+ * Copyright 2020  Jakub Kaszycki
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs cenv serve from the cenv executable given as the first argument
+// and checks that its answers follow what other modes write.
+
+#include "cenv.hh"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static pid_t
+spawn (const std::vector<std::string> &args)
+{
+  std::vector<char *> argv;
+
+  for (const auto &arg : args)
+    argv.push_back (const_cast<char *> (arg.c_str ()));
+
+  argv.push_back (nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_addopen (&actions, STDOUT_FILENO, "/dev/null",
+                                    O_WRONLY, 0);
+
+  pid_t pid;
+  int error = posix_spawnp (&pid, argv[0], &actions, nullptr, argv.data (),
+                            environ);
+  posix_spawn_file_actions_destroy (&actions);
+
+  return error ? -1 : pid;
+}
+
+static bool
+wait_for (pid_t pid)
+{
+  int status;
+
+  while (waitpid (pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return false;
+
+  return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+static bool
+run_command (const std::vector<std::string> &args)
+{
+  pid_t pid = spawn (args);
+  return pid > 0 && wait_for (pid);
+}
+
+static void
+check (bool ok,
+       const char *what)
+{
+  if (!ok)
+    {
+      std::fprintf (stderr, "%s failed\n", what);
+      std::exit (1);
+    }
+}
+
+// Connects to the socket, waiting for the server to start listening
+static int
+connect_to (const std::string &path)
+{
+  struct sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+  path.copy (address.sun_path, sizeof (address.sun_path) - 1);
+
+  for (int tries = 0; tries < 500; ++tries)
+    {
+      int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+      if (fd < 0)
+        return -1;
+
+      if (!connect (fd, reinterpret_cast<const struct sockaddr *> (&address),
+                    sizeof (address)))
+        return fd;
+
+      close (fd);
+
+      const struct timespec pause {0, 10000000};
+      nanosleep (&pause, nullptr);
+    }
+
+  return -1;
+}
+
+// Sends one request and returns the output, or an empty string for an
+// error
+static std::string
+query (int fd,
+       const std::string &request)
+{
+  const std::string line {request + '\n'};
+
+  if (send (fd, line.data (), line.size (), MSG_NOSIGNAL)
+      != (ssize_t) line.size ())
+    return {};
+
+  std::string reply;
+  char c;
+
+  while (read (fd, &c, 1) == 1 && c != '\n')
+    reply.push_back (c);
+
+  if (reply.compare (0, 3, "ok "))
+    return {};
+
+  std::size_t left = std::strtoul (reply.c_str () + 3, nullptr, 10);
+  std::string output (left, '\0');
+  char *p = &output[0];
+
+  while (left)
+    {
+      ssize_t got = read (fd, p, left);
+
+      if (got <= 0)
+        return {};
+
+      p += got;
+      left -= got;
+    }
+
+  return output;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  if (argc != 2)
+    {
+      std::fprintf (stderr, "Usage: %s path/to/cenv\n", argv[0]);
+      return 2;
+    }
+
+  const std::string cenv {argv[1]};
+  char parent[] = "/tmp/cenv-test-XXXXXX";
+
+  if (!mkdtemp (parent))
+    {
+      std::perror ("Creating the folder");
+      return 1;
+    }
+
+  const std::string folder {std::string {parent} + "/env"};
+  const std::string socket_path {std::string {parent} + "/socket"};
+
+  check (run_command ({cenv, folder}), "Creating the environment");
+  check (!mkdir ((folder + "/lib").c_str (), 0755), "Creating lib");
+  cenv::replace_file (folder + "/lib/libtest.so", "");
+
+  pid_t server = spawn ({cenv, "serve", socket_path});
+  check (server > 0, "Starting the server");
+
+  int fd = connect_to (socket_path);
+  check (fd >= 0, "Connecting to the server");
+
+  const std::string before {query (fd, "env " + folder)};
+  check (before.find ("LD_LIBRARY_PATH=" + folder + "/lib\n")
+         != std::string::npos, "Resolving the environment");
+
+  // Only the hash and the scripts change, the manifest stays the same
+  check (run_command ({cenv, "index-libs", folder}), "Indexing libraries");
+
+  const std::string after {query (fd, "env " + folder)};
+  check (after.find ("LD_LIBRARY_PATH=" + folder + "/.cenv/lib\n")
+         != std::string::npos, "Resolving the indexed environment");
+
+  close (fd);
+  kill (server, SIGTERM);
+  check (wait_for (server), "Stopping the server");
+
+  cenv::remove_tree (parent);
+  return 0;
+}